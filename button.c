@@ -0,0 +1,272 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+/*
+
+Button Input
+============
+
+The levels of all eight buttons are fed to a debouncer as one mask, either
+from a single read of the GPIO level register (poll_buttons) or, one edge at
+a time, from the GPIO character device.  The debouncer turns them into press,
+release, long press, repeat and chord events.
+
+Debouncing takes the leading edge: the first change on a quiet button is
+reported at once, then the button is locked out for BUTTON_DEBOUNCE_NS.
+Changes during the lockout are contact bounce and are held back; if the level
+still differs when the lockout ends (a quick release, say), it is taken then.
+
+With the character device the lines are requested active-low, so a pressed
+button reads 1 and pressing it is a rising edge.  The input thread sleeps in
+poll() until an edge or the debouncer's next deadline, and each edge carries
+the time the kernel saw it.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+#include "rpilcd.h"
+#include "button.h"
+
+const int button_gpio[BUTTON_COUNT] = {
+    LCD_BUTTON_VOLUP, LCD_BUTTON_FILE, LCD_BUTTON_NOW, LCD_BUTTON_VOL,
+    LCD_BUTTON_VOLDOWN, LCD_BUTTON_RW, LCD_BUTTON_PLAY, LCD_BUTTON_FF };
+
+// File descriptor of the requested lines, or -1.
+int button_fd = -1;
+
+// Levels of the lines after the last edge returned (bit n is GPIO n).
+unsigned int button_raw;
+
+// Edges read from the kernel but not yet returned by button_wait.
+struct gpio_v2_line_event button_edges[16];
+int button_edges_count, button_edges_next;
+
+int button_first(unsigned int mask)
+{
+    int i = 0;
+    for (i = 0; i < BUTTON_COUNT; i++)
+    {
+        if (mask & (1u << button_gpio[i])) return button_gpio[i];
+    }
+    return LCD_BUTTON_NONE;
+}
+
+unsigned long long button_time_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void button_debounce_init(struct button_debounce_t *d,
+    unsigned int repeat_mask)
+{
+    memset(d, 0, sizeof(*d));
+    d->repeat_mask = repeat_mask;
+}
+
+// Interval between repeat n (counting from 0) and the next one.
+unsigned long long button_repeat_interval(int n)
+{
+    unsigned long long step = (unsigned long long)n * BUTTON_REPEAT_STEP_NS;
+    if (step >= BUTTON_REPEAT_START_NS - BUTTON_REPEAT_MIN_NS)
+        return BUTTON_REPEAT_MIN_NS;
+    return BUTTON_REPEAT_START_NS - step;
+}
+
+// Append an event to the array passed to button_debounce_update.
+void button_emit(const struct button_debounce_t *d,
+    struct button_event_t *events, int *n, int max_events,
+    unsigned long long now, enum button_event_type_t type, int button,
+    int flags)
+{
+    if (*n >= max_events) return;
+    events[*n].type = type;
+    events[*n].button = button;
+    events[*n].held = d->state;
+    events[*n].flags = flags;
+    events[*n].time_ns = now;
+    (*n)++;
+}
+
+int button_debounce_update(struct button_debounce_t *d, unsigned int raw,
+    unsigned long long now, struct button_event_t *events, int max_events)
+{
+    int n = 0;
+    d->raw = raw;
+
+    int i = 0;
+    for (i = 0; i < BUTTON_COUNT; i++)
+    {
+        int b = button_gpio[i];
+        unsigned int bit = 1u << b;
+
+        if (((raw ^ d->state) & bit) && now >= d->lockout[i])
+        {
+            d->state ^= bit;
+            d->lockout[i] = now + BUTTON_DEBOUNCE_NS;
+            if (d->state & bit)
+            {
+                d->pressed_at[i] = now;
+                d->next_repeat[i] = now + BUTTON_REPEAT_DELAY_NS;
+                d->repeats[i] = 0;
+                d->long_sent &= ~bit;
+                d->chorded &= ~bit;
+                button_emit(d, events, &n, max_events, now, BUTTON_PRESS,
+                    b, 0);
+                if (d->state & ~bit)
+                {
+                    d->chorded |= d->state;
+                    button_emit(d, events, &n, max_events, now,
+                        BUTTON_CHORD, b, BUTTON_FLAG_CHORD);
+                }
+            } else {
+                int flags = ((d->long_sent & bit) ? BUTTON_FLAG_LONG : 0) |
+                    ((d->chorded & bit) ? BUTTON_FLAG_CHORD : 0);
+                button_emit(d, events, &n, max_events, now, BUTTON_RELEASE,
+                    b, flags);
+            }
+        }
+
+        if (!(d->state & bit)) continue;
+        if (d->repeat_mask & bit)
+        {
+            if (now >= d->next_repeat[i])
+            {
+                // Send one repeat however late this call is, rather than a
+                // burst to catch up.
+                d->next_repeat[i] =
+                    now + button_repeat_interval(d->repeats[i]);
+                d->repeats[i]++;
+                button_emit(d, events, &n, max_events, now, BUTTON_REPEAT,
+                    b, 0);
+            }
+        } else if (!(d->long_sent & bit) &&
+            now >= d->pressed_at[i] + BUTTON_LONG_NS)
+        {
+            d->long_sent |= bit;
+            button_emit(d, events, &n, max_events, now, BUTTON_LONG, b,
+                BUTTON_FLAG_LONG |
+                ((d->chorded & bit) ? BUTTON_FLAG_CHORD : 0));
+        }
+    }
+    return n;
+}
+
+unsigned long long button_debounce_deadline(const struct button_debounce_t *d)
+{
+    unsigned long long deadline = 0;
+    int i = 0;
+    for (i = 0; i < BUTTON_COUNT; i++)
+    {
+        unsigned int bit = 1u << button_gpio[i];
+        unsigned long long t = 0;
+        if ((d->raw ^ d->state) & bit) t = d->lockout[i];
+        else if (!(d->state & bit)) continue;
+        else if (d->repeat_mask & bit) t = d->next_repeat[i];
+        else if (!(d->long_sent & bit)) t = d->pressed_at[i] + BUTTON_LONG_NS;
+        else continue;
+        if (deadline == 0 || t < deadline) deadline = t;
+    }
+    return deadline;
+}
+
+int button_open_chip(const char *path)
+{
+    int chip = open(path, O_RDONLY | O_CLOEXEC);
+    if (chip < 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    int i = 0;
+    for (i = 0; i < BUTTON_COUNT; i++) req.offsets[i] = button_gpio[i];
+    req.num_lines = BUTTON_COUNT;
+    strncpy(req.consumer, "rpilcd buttons", sizeof(req.consumer) - 1);
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_ACTIVE_LOW |
+        GPIO_V2_LINE_FLAG_BIAS_PULL_UP | GPIO_V2_LINE_FLAG_EDGE_RISING |
+        GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    int r = ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(chip);
+    if (r < 0)
+    {
+        fprintf(stderr, "Could not request button lines from %s: %s\n",
+            path, strerror(errno));
+        return 1;
+    }
+    button_fd = req.fd;
+    button_edges_count = button_edges_next = 0;
+
+    // Start from the current levels so a button held at start up is seen
+    // as soon as anything is fed to the debouncer.
+    struct gpio_v2_line_values values;
+    memset(&values, 0, sizeof(values));
+    values.mask = (1ULL << BUTTON_COUNT) - 1;
+    button_raw = 0;
+    if (ioctl(button_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) == 0)
+    {
+        for (i = 0; i < BUTTON_COUNT; i++)
+        {
+            if (values.bits & (1ULL << i)) button_raw |= 1u << button_gpio[i];
+        }
+    }
+    return 0;
+}
+
+int button_wait(int timeout_ms, unsigned int *raw,
+    unsigned long long *timestamp_ns)
+{
+    if (button_fd < 0) return -1;
+    while (button_edges_next >= button_edges_count)
+    {
+        struct pollfd p = { button_fd, POLLIN, 0 };
+        int n = poll(&p, 1, timeout_ms);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0)
+        {
+            fprintf(stderr, "Could not wait for buttons: %s\n",
+                strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+        {
+            *raw = button_raw;
+            return 0;
+        }
+        ssize_t len = read(button_fd, button_edges, sizeof(button_edges));
+        if (len < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            fprintf(stderr, "Could not read button events: %s\n",
+                strerror(errno));
+            return -1;
+        }
+        button_edges_count = len / sizeof(button_edges[0]);
+        button_edges_next = 0;
+    }
+
+    const struct gpio_v2_line_event *e = &button_edges[button_edges_next++];
+    if (e->id == GPIO_V2_LINE_EVENT_RISING_EDGE) button_raw |= 1u << e->offset;
+    else button_raw &= ~(1u << e->offset);
+    *raw = button_raw;
+    *timestamp_ns = e->timestamp_ns;
+    return 1;
+}
+
+void button_close_chip()
+{
+    if (button_fd >= 0) close(button_fd);
+    button_fd = -1;
+}
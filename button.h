@@ -0,0 +1,177 @@
+#ifndef BUTTON_H
+#define BUTTON_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+/*!
+ * Number of buttons on the board.
+ */
+#define BUTTON_COUNT 8
+
+/*!
+ * Time after a button changes during which further changes are treated as
+ * contact bounce, in nanoseconds.
+ */
+#define BUTTON_DEBOUNCE_NS 20000000ULL
+
+/*!
+ * Time a button must be held for a long press, in nanoseconds.
+ */
+#define BUTTON_LONG_NS 800000000ULL
+
+/*!
+ * Time a repeating button must be held before it starts repeating, and the
+ * first and fastest intervals between repeats, in nanoseconds.  Each repeat
+ * comes BUTTON_REPEAT_STEP_NS sooner than the last until the fastest rate
+ * is reached.
+ */
+#define BUTTON_REPEAT_DELAY_NS 400000000ULL
+#define BUTTON_REPEAT_START_NS 250000000ULL
+#define BUTTON_REPEAT_MIN_NS 60000000ULL
+#define BUTTON_REPEAT_STEP_NS 30000000ULL
+
+/*!
+ * GPIO numbers of the buttons (the LCD_BUTTON_* definitions), in the order
+ * poll_button_press checks them.
+ */
+extern const int button_gpio[BUTTON_COUNT];
+
+/*!
+ * Kinds of event produced by the debouncer.
+ */
+enum button_event_type_t
+{
+    BUTTON_PRESS,
+    BUTTON_RELEASE,
+    /*! The button has been held for BUTTON_LONG_NS (not repeating buttons). */
+    BUTTON_LONG,
+    /*! A repeating button is still held down. */
+    BUTTON_REPEAT,
+    /*! A button was pressed while others were held down. */
+    BUTTON_CHORD
+};
+
+/*!
+ * The press was held long enough for a BUTTON_LONG event.
+ */
+#define BUTTON_FLAG_LONG 1
+/*!
+ * Another button was pressed while this one was held down.
+ */
+#define BUTTON_FLAG_CHORD 2
+
+/*!
+ * A debounced button event.
+ */
+struct button_event_t
+{
+    enum button_event_type_t type;
+    /*!
+     * GPIO number of the button.  For a chord, the button that completed it.
+     */
+    int button;
+    /*!
+     * Buttons held down after the event (bit n is GPIO n).
+     */
+    unsigned int held;
+    /*!
+     * BUTTON_FLAG_* bits describing the press so far.  On release these
+     * tell whether the press was already used for something else.
+     */
+    int flags;
+    /*!
+     * CLOCK_MONOTONIC time of the event in nanoseconds.
+     */
+    unsigned long long time_ns;
+};
+
+/*!
+ * State of the debouncer for all the buttons.
+ */
+struct button_debounce_t
+{
+    // Last levels passed to button_debounce_update and the debounced state.
+    unsigned int raw, state;
+    // Buttons that auto-repeat instead of sending a long press.
+    unsigned int repeat_mask;
+    // Buttons that have sent BUTTON_LONG, and that have been part of a chord,
+    // since they were pressed.
+    unsigned int long_sent, chorded;
+    // Per button (indexed as button_gpio): end of the bounce lockout, time of
+    // the press, time of the next repeat and the number of repeats sent.
+    unsigned long long lockout[BUTTON_COUNT];
+    unsigned long long pressed_at[BUTTON_COUNT];
+    unsigned long long next_repeat[BUTTON_COUNT];
+    int repeats[BUTTON_COUNT];
+};
+
+/*!
+ * Return the first button in button_gpio order that is set in a mask of
+ * buttons (bit n is GPIO n), or LCD_BUTTON_NONE if the mask is empty.
+ */
+int button_first(unsigned int mask);
+
+/*!
+ * Return the CLOCK_MONOTONIC time in nanoseconds, the clock used for all
+ * button timestamps.
+ */
+unsigned long long button_time_ns();
+
+/*!
+ * Reset a debouncer with all buttons released.
+ * \param repeat_mask Buttons that auto-repeat while held (bit n is GPIO n).
+ */
+void button_debounce_init(struct button_debounce_t *d,
+    unsigned int repeat_mask);
+
+/*!
+ * Feed the levels of all the buttons to the debouncer and collect the
+ * events that result.  A change is taken at once unless the button changed
+ * less than BUTTON_DEBOUNCE_NS ago, in which case it is taken when that
+ * time is up (if the level still differs).  Must also be called at the time
+ * given by button_debounce_deadline even if nothing changed.
+ * \param raw Buttons held down (bit n is GPIO n).
+ * \param now CLOCK_MONOTONIC time of the levels in nanoseconds.
+ * \param events Array for the events produced.
+ * \param max_events Size of the events array; further events are lost.
+ * \return The number of events written.
+ */
+int button_debounce_update(struct button_debounce_t *d, unsigned int raw,
+    unsigned long long now, struct button_event_t *events, int max_events);
+
+/*!
+ * Return the time button_debounce_update must next be called by to send
+ * long press and repeat events and finish debouncing, or 0 if it only needs
+ * to be called when the levels change.
+ */
+unsigned long long button_debounce_deadline(const struct button_debounce_t *d);
+
+/*!
+ * Request the button lines from a GPIO character device (for example
+ * /dev/gpiochip0) as active-low inputs with pull-ups, with the kernel
+ * reporting both edges.  Line offsets are the GPIO numbers in button_gpio.
+ * \return 0 on success.  On failure buttons can still be read with
+ * poll_buttons.
+ */
+int button_open_chip(const char *path);
+
+/*!
+ * Wait for the next edge on one of the button lines.  Edges are returned
+ * one at a time, bounces included, for button_debounce_update.
+ * \param timeout_ms Longest time to wait, or -1 to wait for an edge.
+ * \param raw Set to the buttons held down after the edge (bit n is GPIO n).
+ * \param timestamp_ns Set to the CLOCK_MONOTONIC time of the edge, taken by
+ * the kernel when it arrived.
+ * \return 1 for an edge, 0 on timeout and -1 on error.
+ */
+int button_wait(int timeout_ms, unsigned int *raw,
+    unsigned long long *timestamp_ns);
+
+/*!
+ * Release the button lines requested by button_open_chip.
+ */
+void button_close_chip();
+
+#endif
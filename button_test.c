@@ -0,0 +1,52 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+#include <stdio.h>
+#include "rpilcd.h"
+#include "button.h"
+
+int main(int argc, char* argv[])
+{
+    // Print the debounced button events.  The GPIO chip can be given as the
+    // first argument, for example a gpio-sim chip.
+    const char *names[] = { "press", "release", "long", "repeat", "chord" };
+    const char *chip = (argc > 1) ? argv[1] : "/dev/gpiochip0";
+    if (button_open_chip(chip) != 0) return 1;
+
+    struct button_debounce_t debounce;
+    struct button_event_t events[16];
+    button_debounce_init(&debounce,
+        (1u << LCD_BUTTON_VOLUP) | (1u << LCD_BUTTON_VOLDOWN));
+    int timeout_ms = 0;
+    while (1)
+    {
+        unsigned int raw = 0;
+        unsigned long long t = 0;
+        int r = button_wait(timeout_ms, &raw, &t);
+        if (r < 0) break;
+        if (r == 0) t = button_time_ns();
+        int n = button_debounce_update(&debounce, raw, t, events, 16);
+        int i = 0;
+        for (i = 0; i < n; i++)
+        {
+            printf("%llu.%06llu %-7s %2d held %08x flags %d\n",
+                events[i].time_ns / 1000000000ULL,
+                (events[i].time_ns / 1000) % 1000000ULL,
+                names[events[i].type], events[i].button, events[i].held,
+                events[i].flags);
+        }
+        fflush(stdout);
+
+        unsigned long long deadline = button_debounce_deadline(&debounce);
+        unsigned long long now = button_time_ns();
+        timeout_ms = -1;
+        if (deadline)
+        {
+            timeout_ms = (deadline > now) ?
+                (deadline - now + 999999) / 1000000 : 0;
+        }
+    }
+    button_close_chip();
+    return 1;
+}
@@ -0,0 +1,110 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+/*
+
+Feeds a script of button levels through the debouncer, as the GPIO
+character device or poll_buttons would, and checks the events that come out
+and the deadline it asks to be called back by.
+
+*/
+#include <stdio.h>
+#include <string.h>
+#include "rpilcd.h"
+#include "button.h"
+
+#define PLAY (1u << LCD_BUTTON_PLAY)
+#define VOLUP (1u << LCD_BUTTON_VOLUP)
+#define VOLDOWN (1u << LCD_BUTTON_VOLDOWN)
+
+// Levels fed at a time, the events expected from them (type, GPIO and flags
+// of each) and the deadline expected afterwards, all times in milliseconds.
+struct step_t
+{
+    int time_ms;
+    unsigned int raw;
+    const char *events;
+    int deadline_ms;
+};
+
+const struct step_t script[] = {
+    // Bounces after a press and after a release are ignored.
+    { 0, PLAY, "press 18 0", 800 },
+    { 2, 0, "", 20 },
+    { 5, PLAY, "", 800 },
+    { 100, 0, "release 18 0", 0 },
+    { 105, PLAY, "", 120 },
+    { 110, 0, "", 0 },
+    { 120, 0, "", 0 },
+    // A release during the lockout is taken when the lockout ends.
+    { 200, PLAY, "press 18 0", 1000 },
+    { 210, 0, "", 220 },
+    { 220, 0, "release 18 0", 0 },
+    // Holding a button that does not repeat sends one long press.
+    { 300, PLAY, "press 18 0", 1100 },
+    { 1100, PLAY, "long 18 1", 0 },
+    { 1200, 0, "release 18 1", 0 },
+    // Repeats start after 400ms, 250ms apart, then come 30ms sooner each
+    // time.  A late call sends one repeat, not a burst.
+    { 2000, VOLUP, "press 9 0", 2400 },
+    { 2400, VOLUP, "repeat 9 0", 2650 },
+    { 2650, VOLUP, "repeat 9 0", 2870 },
+    { 3000, VOLUP, "repeat 9 0", 3190 },
+    { 3100, 0, "release 9 0", 0 },
+    { 3120, 0, "", 0 },
+    // Pressing a second button makes a chord, and both releases say so.
+    { 4000, PLAY, "press 18 0", 4800 },
+    { 4100, PLAY | VOLDOWN, "press 14 0 chord 14 2", 4500 },
+    { 4200, VOLDOWN, "release 18 2", 4500 },
+    { 4250, 0, "release 14 2", 0 },
+};
+
+int main(int argc, char* argv[])
+{
+    const char *names[] = { "press", "release", "long", "repeat", "chord" };
+    struct button_debounce_t debounce;
+    struct button_event_t events[16];
+    button_debounce_init(&debounce, VOLUP | VOLDOWN);
+
+    int failed = 0;
+    int i = 0;
+    for (i = 0; i < sizeof(script) / sizeof(script[0]); i++)
+    {
+        const struct step_t *s = &script[i];
+        unsigned long long now = s->time_ms * 1000000ULL;
+        int n = button_debounce_update(&debounce, s->raw, now, events, 16);
+
+        char got[128] = "";
+        int j = 0, len = 0;
+        for (j = 0; j < n; j++)
+        {
+            len += snprintf(got + len, sizeof(got) - len, "%s%s %d %d",
+                j ? " " : "", names[events[j].type], events[j].button,
+                events[j].flags);
+            if (events[j].time_ns != now || events[j].held != debounce.state)
+            {
+                fprintf(stderr, "%dms: %s event has the wrong time or "
+                    "buttons held\n", s->time_ms, names[events[j].type]);
+                failed = 1;
+            }
+        }
+        if (strcmp(got, s->events) != 0)
+        {
+            fprintf(stderr, "%dms: events \"%s\", expected \"%s\"\n",
+                s->time_ms, got, s->events);
+            failed = 1;
+        }
+
+        unsigned long long deadline = button_debounce_deadline(&debounce);
+        if (deadline != s->deadline_ms * 1000000ULL)
+        {
+            fprintf(stderr, "%dms: deadline %llums, expected %dms\n",
+                s->time_ms, deadline / 1000000ULL, s->deadline_ms);
+            failed = 1;
+        }
+    }
+    if (failed) return 1;
+    printf("debounce_test ok\n");
+    return 0;
+}
@@ -0,0 +1,455 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dirlist.h"
+
+// Entries read by the loader thread between handing them over.
+#define DIRLIST_BATCH 64
+
+// Return 1 if a file name has an extension the player can play.
+int dirlist_is_audio_name(const char *name)
+{
+    int len = strlen(name);
+    return len >= 4 && (strcmp(name + len - 4, ".mp3") == 0 ||
+        strcmp(name + len - 4, ".ogg") == 0);
+}
+
+// Work out whether an entry is a directory (1), a regular file (0) or
+// neither (-1), using stat only if readdir did not say.
+int dirlist_is_dir(int fd, const struct dirent *d)
+{
+    if (d->d_type == DT_DIR) return 1;
+    if (d->d_type == DT_REG) return 0;
+    if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK) return -1;
+    // Symbolic links are followed, as they would be by open.
+    struct stat st;
+    if (fstatat(fd, d->d_name, &st, 0) != 0) return -1;
+    if (S_ISDIR(st.st_mode)) return 1;
+    return S_ISREG(st.st_mode) ? 0 : -1;
+}
+
+// Decide whether to list an entry and as what.  Returns 0 to list it.
+int dirlist_classify(int fd, const struct dirent *d, int flags,
+    enum dirlist_type_t *type)
+{
+    // Skip files that cannot be played, and hidden names that could only
+    // be directories, before looking any further at them.
+    int hidden = d->d_name[0] == '.' && strcmp(d->d_name, ".") != 0 &&
+        strcmp(d->d_name, "..") != 0;
+    int audio_name = dirlist_is_audio_name(d->d_name);
+    if ((hidden || (flags & DIRLIST_AUDIO_ONLY)) && !audio_name) return 1;
+    int is_dir = dirlist_is_dir(fd, d);
+    if (is_dir == 1 && !hidden && !(flags & DIRLIST_AUDIO_ONLY))
+        *type = DIRLIST_DIR;
+    else if (is_dir == 0 && audio_name) *type = DIRLIST_AUDIO;
+    else return 1;
+    return 0;
+}
+
+// Arena of the listing being sorted by dirlist_cmp.  Listings are sorted on
+// the main loop, the loader thread and the library thread at once.
+__thread const char *dirlist_sort_arena;
+
+// Order entries by type, then by name.
+int dirlist_cmp(const void *a, const void *b)
+{
+    const struct dirlist_entry_t *e1 = a, *e2 = b;
+    if (e1->type != e2->type) return (e1->type < e2->type) ? -1 : 1;
+    if (e1->key != e2->key) return (e1->key < e2->key) ? -1 : 1;
+    return strcmp(dirlist_sort_arena + e1->name,
+        dirlist_sort_arena + e2->name);
+}
+
+int dirlist_read(struct dirlist_t *list, const char *path, int flags)
+{
+    memset(list, 0, sizeof(*list));
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        fprintf(stderr, "Could not read directory %s: %s\n", path,
+            strerror(errno));
+        return 1;
+    }
+
+    int fd = dirfd(dir);
+    struct dirent *d;
+    while ((d = readdir(dir)))
+    {
+        enum dirlist_type_t type;
+        if (dirlist_classify(fd, d, flags, &type) != 0) continue;
+        if (dirlist_add(list, type, d->d_name) != 0) break;
+    }
+    closedir(dir);
+    dirlist_sort(list);
+    return 0;
+}
+
+void dirlist_sort(struct dirlist_t *list)
+{
+    dirlist_sort_arena = list->arena;
+    qsort(list->entries, list->count, sizeof(*list->entries), &dirlist_cmp);
+}
+
+// Make room for count items in an array.
+int dirlist_grow(void **items, int *size, int count, size_t item_size)
+{
+    if (count <= *size) return 0;
+    int new_size = *size ? *size : 64;
+    while (new_size < count) new_size *= 2;
+    void *p = realloc(*items, new_size * item_size);
+    if (!p) return 1;
+    *items = p;
+    *size = new_size;
+    return 0;
+}
+
+int dirlist_add(struct dirlist_t *list, enum dirlist_type_t type,
+    const char *name)
+{
+    // The title comes first, aligned for its length.  Most names are shown
+    // as they are, and then the title's text is the name too.  Otherwise
+    // the name follows the title.
+    int len = strlen(name);
+    int title_at = (list->arena_len + sizeof(int) - 1) & ~(sizeof(int) - 1);
+    int name_at = title_at + title_size(name, 0);
+    if (dirlist_grow((void**)&list->arena, &list->arena_size,
+            name_at + len + 1, 1) != 0 ||
+        dirlist_grow((void**)&list->entries, &list->size, list->count + 1,
+            sizeof(*list->entries)) != 0) return 1;
+
+    // Names are shown with their extensions so that files can be told from
+    // directories.
+    struct title_t *t = (struct title_t*)(list->arena + title_at);
+    title_prepare(t, name, 0);
+    if (t->len == len && memcmp(t->text, name, len) == 0)
+    {
+        name_at = title_at + sizeof(struct title_t);
+        list->arena_len = title_at + title_size(name, 0);
+    } else {
+        memcpy(list->arena + name_at, name, len + 1);
+        list->arena_len = name_at + len + 1;
+    }
+
+    struct dirlist_entry_t *e = &list->entries[list->count++];
+    const unsigned char *s = (const unsigned char*)name;
+    e->name = name_at;
+    e->title = title_at;
+    e->key = 0;
+    int i = 0;
+    for (i = 0; i < 4; i++) e->key = (e->key << 8) | (i < len ? s[i] : 0);
+    e->len = len;
+    e->type = type;
+    return 0;
+}
+
+// Make room for the entries of another listing and copy its arena after the
+// listing's own.  Returns the offset of the copy, which is added to the
+// entries' offsets, or -1 if out of memory.
+int dirlist_append_arena(struct dirlist_t *list, const struct dirlist_t *from)
+{
+    // Keep the alignment of the titles.
+    int base = (list->arena_len + sizeof(int) - 1) & ~(sizeof(int) - 1);
+    if (dirlist_grow((void**)&list->arena, &list->arena_size,
+            base + from->arena_len, 1) != 0 ||
+        dirlist_grow((void**)&list->entries, &list->size,
+            list->count + from->count, sizeof(*list->entries)) != 0)
+        return -1;
+    memcpy(list->arena + base, from->arena, from->arena_len);
+    list->arena_len = base + from->arena_len;
+    return base;
+}
+
+int dirlist_append(struct dirlist_t *list, const struct dirlist_t *from)
+{
+    int base = dirlist_append_arena(list, from);
+    if (base < 0) return 1;
+    int i = 0;
+    for (i = 0; i < from->count; i++)
+    {
+        struct dirlist_entry_t *e = &list->entries[list->count++];
+        *e = from->entries[i];
+        e->name += base;
+        e->title += base;
+    }
+    return 0;
+}
+
+int dirlist_merge(struct dirlist_t *list, const struct dirlist_t *from)
+{
+    int base = dirlist_append_arena(list, from);
+    if (base < 0) return 1;
+    // Fill the entries from the end, taking the greater of the last
+    // entries not yet placed.  The entries of from go after equal ones.
+    struct dirlist_entry_t e;
+    int i = list->count - 1, j = from->count - 1;
+    int k = list->count + from->count - 1;
+    dirlist_sort_arena = list->arena;
+    while (j >= 0)
+    {
+        e = from->entries[j];
+        e.name += base;
+        e.title += base;
+        if (i >= 0 && dirlist_cmp(&list->entries[i], &e) > 0)
+        {
+            list->entries[k--] = list->entries[i--];
+        } else {
+            list->entries[k--] = e;
+            j--;
+        }
+    }
+    list->count += from->count;
+    return 0;
+}
+
+const char *dirlist_name(const struct dirlist_t *list, int i)
+{
+    return list->arena + list->entries[i].name;
+}
+
+const struct title_t *dirlist_title(const struct dirlist_t *list, int i)
+{
+    return (const struct title_t*)(list->arena + list->entries[i].title);
+}
+
+void dirlist_free(struct dirlist_t *list)
+{
+    free(list->entries);
+    free(list->arena);
+    memset(list, 0, sizeof(*list));
+}
+
+long long dirlist_mtime(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    return (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Free a slot of the cache.
+void dirlist_cache_drop(struct dirlist_cache_t *cache, int i)
+{
+    free(cache->entry[i].path);
+    cache->entry[i].path = 0;
+    dirlist_free(&cache->entry[i].list);
+}
+
+void dirlist_cache_put(struct dirlist_cache_t *cache, const char *path,
+    long long mtime, struct dirlist_t *list, int position)
+{
+    char *copy = (mtime >= 0) ? strdup(path) : 0;
+    if (!copy)
+    {
+        dirlist_free(list);
+        return;
+    }
+    // Use the slot of the same path, or a free one, or the one used least
+    // recently.
+    int i = 0, slot = 0;
+    for (i = 0; i < DIRLIST_CACHE_SIZE; i++)
+    {
+        if (cache->entry[i].path && strcmp(cache->entry[i].path, path) == 0)
+        {
+            slot = i;
+            break;
+        }
+        if (!cache->entry[i].path) slot = i;
+        else if (cache->entry[slot].path &&
+            cache->entry[i].used < cache->entry[slot].used) slot = i;
+    }
+    if (cache->entry[slot].path) dirlist_cache_drop(cache, slot);
+    cache->entry[slot].path = copy;
+    cache->entry[slot].mtime = mtime;
+    cache->entry[slot].position = position;
+    cache->entry[slot].list = *list;
+    cache->entry[slot].used = ++cache->clock;
+    memset(list, 0, sizeof(*list));
+}
+
+int dirlist_cache_take(struct dirlist_cache_t *cache, const char *path,
+    long long mtime, struct dirlist_t *list, int *position)
+{
+    int i = 0;
+    for (i = 0; i < DIRLIST_CACHE_SIZE; i++)
+    {
+        if (!cache->entry[i].path || strcmp(cache->entry[i].path, path) != 0)
+            continue;
+        // The directory has changed since it was read.
+        if (mtime < 0 || cache->entry[i].mtime != mtime)
+        {
+            dirlist_cache_drop(cache, i);
+            return 1;
+        }
+        *list = cache->entry[i].list;
+        *position = cache->entry[i].position;
+        free(cache->entry[i].path);
+        cache->entry[i].path = 0;
+        memset(&cache->entry[i].list, 0, sizeof(cache->entry[i].list));
+        return 0;
+    }
+    return 1;
+}
+
+// Drop a reference to a job, freeing it with the last.
+void dirlist_job_release(struct dirlist_job_t *j)
+{
+    if (__atomic_sub_fetch(&j->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    pthread_mutex_destroy(&j->lock);
+    dirlist_free(&j->ready);
+    free(j->path);
+    free(j);
+}
+
+// Hand the entries read so far over to the main loop, sorted so that it
+// only has to merge them.  Nothing is handed over once the job has been
+// cancelled, as the loader's eventfd may be in use for another job.
+void dirlist_load_publish(struct dirlist_job_t *j, struct dirlist_t *batch,
+    int done, int failed)
+{
+    dirlist_sort(batch);
+    pthread_mutex_lock(&j->lock);
+    if (!j->stop)
+    {
+        if (dirlist_merge(&j->ready, batch) != 0)
+        {
+            fprintf(stderr, "Out of memory listing %s\n", j->path);
+            failed = 1;
+        }
+        if (failed) j->failed = 1;
+        j->done = done;
+        uint64_t v = 1;
+        ssize_t r = write(j->fd, &v, sizeof(v));
+        (void)r;
+    }
+    pthread_mutex_unlock(&j->lock);
+    batch->count = 0;
+    batch->arena_len = 0;
+}
+
+void *dirlist_load_thread(void *arg)
+{
+    struct dirlist_job_t *j = arg;
+    struct dirlist_t batch;
+    memset(&batch, 0, sizeof(batch));
+    int failed = 0;
+    DIR *dir = opendir(j->path);
+    if (!dir)
+    {
+        fprintf(stderr, "Could not read directory %s: %s\n", j->path,
+            strerror(errno));
+        failed = 1;
+    } else {
+        int fd = dirfd(dir);
+        struct dirent *d;
+        while (!__atomic_load_n(&j->stop, __ATOMIC_RELAXED) &&
+            (d = readdir(dir)))
+        {
+            enum dirlist_type_t type;
+            if (dirlist_classify(fd, d, j->flags, &type) != 0) continue;
+            if (dirlist_add(&batch, type, d->d_name) != 0)
+            {
+                fprintf(stderr, "Out of memory listing %s\n", j->path);
+                failed = 1;
+                break;
+            }
+            if (batch.count == DIRLIST_BATCH)
+                dirlist_load_publish(j, &batch, 0, 0);
+        }
+        closedir(dir);
+    }
+    dirlist_load_publish(j, &batch, 1, failed);
+    dirlist_free(&batch);
+    dirlist_job_release(j);
+    return 0;
+}
+
+int dirlist_loader_init(struct dirlist_loader_t *l)
+{
+    memset(l, 0, sizeof(*l));
+    l->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (l->fd < 0)
+    {
+        fprintf(stderr, "Could not create directory loader eventfd\n");
+        return 1;
+    }
+    return 0;
+}
+
+int dirlist_load(struct dirlist_loader_t *l, const char *path, int flags)
+{
+    dirlist_load_cancel(l);
+    struct dirlist_job_t *j = calloc(1, sizeof(*j));
+    if (j) j->path = strdup(path);
+    pthread_t thread;
+    if (!j || !j->path)
+    {
+        fprintf(stderr, "Could not start loading %s\n", path);
+        free(j);
+        return 1;
+    }
+    j->flags = flags;
+    j->fd = l->fd;
+    // One reference for the thread and one for the loader.
+    j->refs = 2;
+    pthread_mutex_init(&j->lock, 0);
+    if (pthread_create(&thread, 0, &dirlist_load_thread, j) != 0)
+    {
+        fprintf(stderr, "Could not start loading %s\n", path);
+        pthread_mutex_destroy(&j->lock);
+        free(j->path);
+        free(j);
+        return 1;
+    }
+    // The thread is never waited for.
+    pthread_detach(thread);
+    l->job = j;
+    return 0;
+}
+
+int dirlist_load_take(struct dirlist_loader_t *l, struct dirlist_t *list)
+{
+    uint64_t v;
+    ssize_t r = read(l->fd, &v, sizeof(v));
+    (void)r;
+    struct dirlist_job_t *j = l->job;
+    if (!j) return 0;
+    pthread_mutex_lock(&j->lock);
+    if (dirlist_merge(list, &j->ready) != 0)
+    {
+        fprintf(stderr, "Out of memory listing %s\n", j->path);
+        j->failed = 1;
+    }
+    j->ready.count = 0;
+    j->ready.arena_len = 0;
+    int done = j->done, failed = j->failed;
+    pthread_mutex_unlock(&j->lock);
+    if (!done) return 1;
+    dirlist_load_cancel(l);
+    return failed ? -1 : 0;
+}
+
+void dirlist_load_cancel(struct dirlist_loader_t *l)
+{
+    struct dirlist_job_t *j = l->job;
+    if (!j) return;
+    l->job = 0;
+    pthread_mutex_lock(&j->lock);
+    __atomic_store_n(&j->stop, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&j->lock);
+    // Throw away the wakeup for anything read.  The thread signals the
+    // eventfd only under the lock, so it cannot signal it again.
+    uint64_t v;
+    ssize_t r = read(l->fd, &v, sizeof(v));
+    (void)r;
+    dirlist_job_release(j);
+}
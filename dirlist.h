@@ -0,0 +1,224 @@
+#ifndef DIRLIST_H
+#define DIRLIST_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+#include <pthread.h>
+#include "title.h"
+
+/*!
+ * Only list audio files, not directories, in dirlist_read.
+ */
+#define DIRLIST_AUDIO_ONLY 1
+
+/*!
+ * What a directory entry is.  Directories sort before audio files.
+ */
+enum dirlist_type_t
+{
+    DIRLIST_DIR,
+    DIRLIST_AUDIO
+};
+
+/*!
+ * An entry of a directory listing.  The name and title are kept in the
+ * listing's arena.  Where the title shows the name unchanged, the name is
+ * the title's text rather than a copy of it.
+ */
+struct dirlist_entry_t
+{
+    /*! Offsets of the name and of its title prepared for the LCD. */
+    unsigned int name, title;
+    /*! The first four bytes of the name, most significant first, so most
+     * names are ordered without looking in the arena. */
+    unsigned int key;
+    unsigned short len;
+    unsigned char type;
+};
+
+/*!
+ * The directories and audio files (MP3 and OGG) in a directory, directories
+ * first, each in order of name.
+ */
+struct dirlist_t
+{
+    int count;
+    struct dirlist_entry_t *entries;
+    /*! Number of entries allocated. */
+    int size;
+    /*! Names and titles of the entries, one after another. */
+    char *arena;
+    int arena_len, arena_size;
+};
+
+/*!
+ * List a directory.  Entries are classified from the type readdir reports,
+ * so only entries of unknown type (on file systems that do not report it)
+ * and symbolic links cost a stat.  Hidden directories other than "." and
+ * ".." are left out.
+ * \param flags DIRLIST_AUDIO_ONLY or 0.
+ * \return 0 on success, or 1 if the directory could not be read, in which
+ * case the list is empty.
+ */
+int dirlist_read(struct dirlist_t *list, const char *path, int flags);
+
+/*!
+ * Sort a listing: directories first, each in order of name.
+ */
+void dirlist_sort(struct dirlist_t *list);
+
+/*!
+ * Append an entry to a listing, preparing its title.  The listing is not
+ * sorted again.
+ * \return 0 on success, 1 if out of memory.
+ */
+int dirlist_add(struct dirlist_t *list, enum dirlist_type_t type,
+    const char *name);
+
+/*!
+ * Append the entries of another listing to a listing, without sorting it.
+ * \return 0 on success, 1 if out of memory.
+ */
+int dirlist_append(struct dirlist_t *list, const struct dirlist_t *from);
+
+/*!
+ * Add the entries of a sorted listing to a sorted listing, keeping it
+ * sorted.  Entries already in the listing keep their names' offsets.
+ * \return 0 on success, 1 if out of memory.
+ */
+int dirlist_merge(struct dirlist_t *list, const struct dirlist_t *from);
+
+/*!
+ * \return The name of entry i.
+ */
+const char *dirlist_name(const struct dirlist_t *list, int i);
+
+/*!
+ * \return The name of entry i prepared for the LCD.  Valid until the listing
+ * is added to or freed.
+ */
+const struct title_t *dirlist_title(const struct dirlist_t *list, int i);
+
+/*!
+ * Free a listing, leaving it empty.
+ */
+void dirlist_free(struct dirlist_t *list);
+
+/*!
+ * Number of listings a dirlist_cache_t holds.
+ */
+#define DIRLIST_CACHE_SIZE 8
+
+/*!
+ * Listings of directories visited recently, so that going back to one does
+ * not read it again.  Each is kept with the modification time the directory
+ * had when it was read and the position of the cursor in it.  The least
+ * recently used listing is dropped to make room.  A zeroed cache is empty.
+ */
+struct dirlist_cache_t
+{
+    struct
+    {
+        /*! Path of the directory, or null if the slot is free. */
+        char *path;
+        long long mtime;
+        int position;
+        struct dirlist_t list;
+        /*! Value of clock when the listing was stored. */
+        unsigned long used;
+    } entry[DIRLIST_CACHE_SIZE];
+    unsigned long clock;
+};
+
+/*!
+ * \return The modification time of a directory in nanoseconds, or -1 if it
+ * cannot be stat'ed.
+ */
+long long dirlist_mtime(const char *path);
+
+/*!
+ * Store a listing in the cache, which takes it over, replacing any listing
+ * of the same path.  The listing is freed instead if mtime is -1.
+ */
+void dirlist_cache_put(struct dirlist_cache_t *cache, const char *path,
+    long long mtime, struct dirlist_t *list, int position);
+
+/*!
+ * Take the listing of a directory out of the cache.  A listing made when
+ * the directory had another modification time is freed.
+ * \return 0 if the listing was found, 1 if not, in which case list is left
+ * alone.
+ */
+int dirlist_cache_take(struct dirlist_cache_t *cache, const char *path,
+    long long mtime, struct dirlist_t *list, int *position);
+
+/*!
+ * A directory being read by a loader thread.  A cancelled thread is not
+ * waited for; it finishes the readdir or stat it is in on its own, so the
+ * job is freed by whichever of the thread and the loader lets go of it
+ * last.
+ */
+struct dirlist_job_t
+{
+    char *path;
+    int flags;
+    /*! eventfd of the loader. */
+    int fd;
+    /*! Number of references, from the thread and the loader. */
+    int refs;
+    pthread_mutex_t lock;
+    /*! Set when the loader has let go of the job, to stop the thread.
+     * Set under lock, so that nothing is published after it. */
+    int stop;
+    /*! Entries read and not yet taken, whether the directory has been
+     * read to the end and whether any entries were lost (the directory
+     * could not be read or memory ran out).  Protected by lock. */
+    struct dirlist_t ready;
+    int done, failed;
+};
+
+/*!
+ * Reads a directory on a thread of its own and hands the entries over in
+ * batches, so that a large directory or a slow disk does not hold up the
+ * main loop.
+ */
+struct dirlist_loader_t
+{
+    /*! eventfd, readable when there are entries to take. */
+    int fd;
+    /*! The directory being read, or null. */
+    struct dirlist_job_t *job;
+};
+
+/*!
+ * Set up a loader that is not loading anything.
+ * \return 0 on success.
+ */
+int dirlist_loader_init(struct dirlist_loader_t *l);
+
+/*!
+ * Start reading a directory, as dirlist_read, stopping any directory still
+ * being read.
+ * \return 0 if the thread was started.
+ */
+int dirlist_load(struct dirlist_loader_t *l, const char *path, int flags);
+
+/*!
+ * Merge the entries read since the last call into a sorted listing, as
+ * dirlist_merge.  Each batch is sorted on the loader's thread.  Call when
+ * l->fd is readable.
+ * \return 1 while the directory is still being read, 0 once every entry
+ * has been taken, or -1 if the directory has been read but some entries
+ * were lost, in which case the listing is incomplete.
+ */
+int dirlist_load_take(struct dirlist_loader_t *l, struct dirlist_t *list);
+
+/*!
+ * Stop reading a directory and throw away the entries not yet taken.  Does
+ * not wait for the thread, which stops at its next entry.
+ */
+void dirlist_load_cancel(struct dirlist_loader_t *l);
+
+#endif
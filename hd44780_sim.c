@@ -0,0 +1,142 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+#include <string.h>
+#include "hd44780_sim.h"
+
+// Execution times from the datasheet (270kHz oscillator), and the minimum E
+// cycle time.
+#define HD44780_EXEC_NS         37000
+#define HD44780_EXEC_HOME_NS    1520000
+#define HD44780_CYCLE_NS        500
+
+struct hd44780_t hd44780_sim;
+
+void hd44780_reset(struct hd44780_t *lcd)
+{
+    memset(lcd, 0, sizeof(*lcd));
+    memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+    lcd->increment = 1;
+    lcd->bus_width = 8;
+    lcd->lines = 1;
+}
+
+void hd44780_reset_counters(struct hd44780_t *lcd)
+{
+    lcd->instructions = 0;
+    lcd->writes = 0;
+    lcd->strobes = 0;
+    lcd->bus_ns = 0;
+}
+
+// Move the address counter on after a read or write.  In DDRAM it moves from
+// the end of one line to the start of the next.
+void hd44780_step(struct hd44780_t *lcd)
+{
+    if (lcd->ac_cgram)
+    {
+        lcd->ac = (lcd->ac + lcd->increment) & 0x3f;
+        return;
+    }
+    if (lcd->lines == 1)
+    {
+        lcd->ac += lcd->increment;
+        if (lcd->ac > 0x4f) lcd->ac = 0x00;
+        if (lcd->ac < 0x00) lcd->ac = 0x4f;
+    } else if (lcd->increment > 0)
+    {
+        if (lcd->ac == 0x27) lcd->ac = 0x40;
+        else if (lcd->ac == 0x67) lcd->ac = 0x00;
+        else lcd->ac++;
+    } else {
+        if (lcd->ac == 0x40) lcd->ac = 0x27;
+        else if (lcd->ac == 0x00) lcd->ac = 0x67;
+        else lcd->ac--;
+    }
+}
+
+void hd44780_instruction(struct hd44780_t *lcd, unsigned char c)
+{
+    lcd->instructions++;
+    lcd->bus_ns += HD44780_EXEC_NS;
+    if (c & 0x80)
+    {
+        // Set DDRAM address.
+        lcd->ac = c & 0x7f;
+        lcd->ac_cgram = 0;
+    } else if (c & 0x40)
+    {
+        // Set CGRAM address.
+        lcd->ac = c & 0x3f;
+        lcd->ac_cgram = 1;
+    } else if (c & 0x20)
+    {
+        // Function set.
+        lcd->bus_width = (c & 0x10) ? 8 : 4;
+        lcd->lines = (c & 0x08) ? 2 : 1;
+    } else if (c & 0x10)
+    {
+        // Cursor or display shift; only the cursor (address counter) is
+        // modelled.
+        if (!(c & 0x08))
+        {
+            int increment = lcd->increment;
+            lcd->increment = (c & 0x04) ? 1 : -1;
+            hd44780_step(lcd);
+            lcd->increment = increment;
+        }
+    } else if (c & 0x08)
+    {
+        // Display on/off control.
+        lcd->display = c & 0x07;
+    } else if (c & 0x04)
+    {
+        // Entry mode set (display shift is not modelled).
+        lcd->increment = (c & 0x02) ? 1 : -1;
+    } else if (c & 0x02)
+    {
+        // Return home.
+        lcd->bus_ns += HD44780_EXEC_HOME_NS - HD44780_EXEC_NS;
+        lcd->ac = 0;
+        lcd->ac_cgram = 0;
+    } else if (c & 0x01)
+    {
+        // Clear display.
+        lcd->bus_ns += HD44780_EXEC_HOME_NS - HD44780_EXEC_NS;
+        memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+        lcd->ac = 0;
+        lcd->ac_cgram = 0;
+        lcd->increment = 1;
+    }
+}
+
+void hd44780_write(struct hd44780_t *lcd, unsigned char c)
+{
+    lcd->writes++;
+    lcd->bus_ns += HD44780_EXEC_NS;
+    if (lcd->ac_cgram) lcd->cgram[lcd->ac] = c;
+    else lcd->ddram[lcd->ac] = c;
+    hd44780_step(lcd);
+}
+
+void hd44780_strobe(struct hd44780_t *lcd, unsigned char data, int rs)
+{
+    lcd->strobes++;
+    lcd->bus_ns += HD44780_CYCLE_NS;
+    unsigned char c = data;
+    if (lcd->bus_width == 4)
+    {
+        // Two strobes per byte, high nibble first.
+        if (!lcd->nibble_pending)
+        {
+            lcd->high_nibble = data & 0xf0;
+            lcd->nibble_pending = 1;
+            return;
+        }
+        lcd->nibble_pending = 0;
+        c = lcd->high_nibble | (data >> 4);
+    }
+    if (rs) hd44780_write(lcd, c);
+    else hd44780_instruction(lcd, c);
+}
@@ -0,0 +1,59 @@
+#ifndef HD44780_SIM_H
+#define HD44780_SIM_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+/*!
+ * Software model of a HD44780 controller, driven one E strobe at a time.
+ * Keeps the DDRAM and CGRAM contents and the address counter, and adds up
+ * the time the real controller would take to execute each instruction.
+ */
+struct hd44780_t
+{
+    unsigned char ddram[128];
+    unsigned char cgram[64];
+    /*! Address counter, and whether it points into CGRAM. */
+    int ac, ac_cgram;
+    /*! Entry mode: address counter increments (1) or decrements (-1). */
+    int increment;
+    /*! Function set: interface data length (4 or 8) and number of lines. */
+    int bus_width, lines;
+    /*! Display control bits (display, cursor, blink). */
+    int display;
+    /*! In 4-bit mode, set when the first nibble of a byte has been latched. */
+    int nibble_pending;
+    unsigned char high_nibble;
+    /*! Instructions and data bytes executed, and E strobes seen. */
+    unsigned long instructions, writes, strobes;
+    /*! Modelled time on the bus in nanoseconds: execution time of every
+     * instruction and data write plus the E cycle time of every strobe. */
+    unsigned long long bus_ns;
+};
+
+/*!
+ * The model behind the simulated LCD backends.
+ */
+extern struct hd44780_t hd44780_sim;
+
+/*!
+ * Put the model into its power on state (8-bit interface, one line, DDRAM
+ * cleared).
+ */
+void hd44780_reset(struct hd44780_t*);
+
+/*!
+ * Reset the instruction, write and strobe counts and the modelled time.
+ */
+void hd44780_reset_counters(struct hd44780_t*);
+
+/*!
+ * Latch the data lines on a falling edge of E.
+ *
+ * \param data D7-D0.  On a 4-bit bus only D7-D4 are connected.
+ * \param rs Register select: 0 for instructions, 1 for data.
+ */
+void hd44780_strobe(struct hd44780_t*, unsigned char data, int rs);
+
+#endif
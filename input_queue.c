@@ -0,0 +1,92 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "input_queue.h"
+
+int input_queue_init(struct input_queue_t *q)
+{
+    memset(q, 0, sizeof(*q));
+    q->fd = eventfd(0, EFD_CLOEXEC);
+    if (q->fd < 0)
+    {
+        fprintf(stderr, "Could not create input eventfd: %s\n",
+            strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int input_queue_push(struct input_queue_t *q, int button,
+    unsigned long long time_ns)
+{
+    unsigned int head = q->head;
+    unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= INPUT_QUEUE_SIZE)
+    {
+        __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    struct input_event_t *e = &q->events[head & (INPUT_QUEUE_SIZE - 1)];
+    e->button = button;
+    e->time_ns = time_ns;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&q->pushed, q->pushed + 1, __ATOMIC_RELAXED);
+
+    // Wake the consumer for every event.  Writing only when the queue was
+    // empty would race with a consumer that has just found it empty.
+    input_queue_wake(q);
+    return 0;
+}
+
+int input_queue_pop(struct input_queue_t *q, struct input_event_t *e)
+{
+    unsigned int tail = q->tail;
+    unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return 0;
+    *e = q->events[tail & (INPUT_QUEUE_SIZE - 1)];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    unsigned long long now =
+        (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+    if (now > e->time_ns && now - e->time_ns > q->max_wait_ns)
+        q->max_wait_ns = now - e->time_ns;
+    return 1;
+}
+
+void input_queue_wait(struct input_queue_t *q)
+{
+    uint64_t v;
+    while (read(q->fd, &v, sizeof(v)) < 0 && errno == EINTR);
+}
+
+void input_queue_wake(struct input_queue_t *q)
+{
+    uint64_t v = 1;
+    ssize_t r = write(q->fd, &v, sizeof(v));
+    (void)r;
+}
+
+void input_queue_print_stats(struct input_queue_t *q)
+{
+    fprintf(stderr, "Input events: %lu queued, %lu dropped, "
+        "longest wait %llums\n",
+        __atomic_load_n(&q->pushed, __ATOMIC_RELAXED),
+        __atomic_load_n(&q->dropped, __ATOMIC_RELAXED),
+        q->max_wait_ns / 1000000);
+}
+
+void input_queue_close(struct input_queue_t *q)
+{
+    if (q->fd >= 0) close(q->fd);
+    q->fd = -1;
+}
@@ -0,0 +1,94 @@
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+/*!
+ * Number of events the queue holds (a power of two).
+ */
+#define INPUT_QUEUE_SIZE 64
+
+/*!
+ * A button press waiting to be handled.
+ */
+struct input_event_t
+{
+    /*!
+     * The button (LCD_BUTTON_*, or MODE or QUIT).
+     */
+    int button;
+    /*!
+     * CLOCK_MONOTONIC time of the press in nanoseconds.
+     */
+    unsigned long long time_ns;
+};
+
+/*!
+ * Bounded queue of input events from one producer thread to one consumer
+ * thread.  Neither side takes a lock; the producer publishes each event with
+ * a release store of head and the consumer frees its slot with a release
+ * store of tail.  An eventfd lets the consumer sleep until there is
+ * something to read.
+ */
+struct input_queue_t
+{
+    // Written only by the producer.
+    unsigned int head __attribute__((aligned(64)));
+    unsigned long pushed, dropped;
+
+    // Written only by the consumer.
+    unsigned int tail __attribute__((aligned(64)));
+    unsigned long long max_wait_ns;
+
+    int fd;
+    struct input_event_t events[INPUT_QUEUE_SIZE];
+};
+
+/*!
+ * Set up an empty queue.
+ * \return 0 on success.
+ */
+int input_queue_init(struct input_queue_t *q);
+
+/*!
+ * Add an event to the queue and wake the consumer.  Called only from the
+ * producer thread.
+ * \return 0 on success, or 1 if the queue was full and the event was
+ * dropped.
+ */
+int input_queue_push(struct input_queue_t *q, int button,
+    unsigned long long time_ns);
+
+/*!
+ * Take the oldest event from the queue without waiting.  Called only from
+ * the consumer thread.
+ * \return 1 if an event was taken, 0 if the queue was empty.
+ */
+int input_queue_pop(struct input_queue_t *q, struct input_event_t *e);
+
+/*!
+ * Sleep until input_queue_push or input_queue_wake is called.  Returns at
+ * once if either was called since the last wait, so no wakeup is lost
+ * between an empty input_queue_pop and the wait.
+ */
+void input_queue_wait(struct input_queue_t *q);
+
+/*!
+ * Wake the consumer without adding an event.  Safe to call from a signal
+ * handler.
+ */
+void input_queue_wake(struct input_queue_t *q);
+
+/*!
+ * Print the number of events queued and dropped to stderr.
+ */
+void input_queue_print_stats(struct input_queue_t *q);
+
+/*!
+ * Release the queue's eventfd.
+ */
+void input_queue_close(struct input_queue_t *q);
+
+#endif
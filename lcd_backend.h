@@ -0,0 +1,70 @@
+#ifndef LCD_BACKEND_H
+#define LCD_BACKEND_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+/*!
+ * Operations for one way of connecting a HD44780 LCD (GPIO pins, an I2C
+ * backpack, or no LCD at all).  Timing between instructions is handled by
+ * rpilcd.c; backends only have to meet the timing of a single transfer.
+ */
+struct lcd_backend_t
+{
+    /*!
+     * Name used to choose the backend with lcd_set_backend.
+     */
+    const char *name;
+    /*!
+     * Number of data lines connected to the LCD (4 or 8).  An 8-bit bus
+     * transfers each byte with one E strobe.
+     */
+    int bus_width;
+    /*!
+     * Open the connection to the LCD.
+     * \param arg Backend specific argument (the text after ':' in the
+     * backend specification), or null.
+     * \return 0 on success.
+     */
+    int (*init)(const char *arg);
+    /*!
+     * Wait for the given number of microseconds.
+     */
+    void (*delay_us)(int us);
+    /*!
+     * Write the low four bits of n to D4-D7 with a single E strobe (D0-D3
+     * are low on an 8-bit bus).
+     */
+    void (*write_nibble)(unsigned char n, int char_mode);
+    /*!
+     * Write a byte to the LCD (two E strobes on a 4-bit bus, one on an 8-bit
+     * bus).
+     */
+    void (*write_byte)(unsigned char c, int char_mode);
+    /*!
+     * Read the busy flag.  Null if the backend cannot read from the LCD.
+     */
+    int (*read_busy)();
+    /*!
+     * Close the connection to the LCD.
+     */
+    void (*close)();
+    /*!
+     * Called by the writer thread after each frame has been written.  Null
+     * if the backend has nothing to do then.
+     */
+    void (*flushed)();
+};
+
+#ifndef SIMULATE_LCD
+extern const struct lcd_backend_t lcd_backend_gpio;
+extern const struct lcd_backend_t lcd_backend_gpio8;
+#endif
+extern const struct lcd_backend_t lcd_backend_sim;
+extern const struct lcd_backend_t lcd_backend_sim8;
+extern const struct lcd_backend_t lcd_backend_term;
+extern const struct lcd_backend_t lcd_backend_i2c;
+extern const struct lcd_backend_t lcd_backend_i2c_mock;
+
+#endif
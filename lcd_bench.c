@@ -0,0 +1,250 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+/*
+
+LCD Output Benchmark
+====================
+
+Replays sequences of frames through the simulated HD44780 on a 4-bit and an
+8-bit bus, and reports the commands written and the modelled bus time.  After
+each sequence the model's DDRAM is checked against the last frame.
+
+Two sequences are built in (a scrolling title on the now playing screen and
+moving through the file list, on 2x16 and 4x20 screens).  Frames recorded by
+running the player with RPILCD_RECORD=file can be replayed by naming the file
+on the command line.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rpilcd.h"
+#include "hd44780_sim.h"
+
+#define BENCH_MAX_FRAMES 4096
+
+/*
+ * A sequence of frames for one type of screen.
+ */
+struct recording_t
+{
+    char name[64];
+    enum lcd_screen_type_t type;
+    int width, height;
+    int n_frames;
+    char (*frames)[LCD_MAX_SIZE];
+};
+
+const char *bench_title =
+    "A Very Long Track Title That Does Not Fit On The Screen.mp3";
+
+// Write text into row of frame, padded with spaces to the width.
+void bench_row(struct recording_t *r, char *frame, int row, const char *text)
+{
+    int i = 0;
+    char *dest = frame + row * r->width;
+    for (i = 0; i < r->width && text[i]; i++) dest[i] = text[i];
+    for (; i < r->width; i++) dest[i] = ' ';
+}
+
+// Offset into text of the scroll animation step, as on the player's screens.
+int bench_scroll(const char *text, int length, int scroll_pos)
+{
+    int tlen = strlen(text);
+    int steps = tlen - length + 10;
+    if (tlen <= length || (scroll_pos % steps) <= 5) return 0;
+    return ((scroll_pos - 5) % steps > (tlen - length)) ?
+        (tlen - length) : ((scroll_pos - 5) % steps);
+}
+
+void bench_init(struct recording_t *r, const char *name,
+        enum lcd_screen_type_t type, int width, int height)
+{
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->type = type;
+    r->width = width;
+    r->height = height;
+    r->n_frames = 0;
+    r->frames = malloc(BENCH_MAX_FRAMES * LCD_MAX_SIZE);
+}
+
+// The now playing screen while a long title scrolls (a step every 350ms, so
+// the clock changes every third frame).
+void bench_scroll_title(struct recording_t *r)
+{
+    int i = 0;
+    for (i = 0; i < 120; i++)
+    {
+        char *frame = r->frames[r->n_frames++];
+        char line[LCD_MAX_SIZE + 1];
+        int seconds = i / 3;
+        const char *title =
+            bench_title + bench_scroll(bench_title, r->width, i);
+        if (r->height == 4)
+        {
+            bench_row(r, frame, 0, "    Now Playing     ");
+            snprintf(line, sizeof(line), "> %02d:%02d",
+                seconds / 60, seconds % 60);
+            bench_row(r, frame, 1, line);
+            bench_row(r, frame, 2, title);
+            bench_row(r, frame, 3, "");
+        } else {
+            snprintf(line, sizeof(line), "> %-*s%02d:%02d", r->width - 7,
+                "PLAYING", seconds / 60, seconds % 60);
+            bench_row(r, frame, 0, line);
+            bench_row(r, frame, 1, title);
+        }
+    }
+}
+
+// Moving down and back up the file list, one entry per frame.
+void bench_file_list(struct recording_t *r)
+{
+    char names[40][48];
+    int i = 0, pos = 0;
+    for (i = 0; i < 40; i++)
+    {
+        if (i < 8) snprintf(names[i], sizeof(names[i]), "Album %02d", i);
+        else snprintf(names[i], sizeof(names[i]),
+            "%02d - Track number %d of the album.mp3", i - 7, i - 7);
+    }
+    for (i = 0; i < 60; i++)
+    {
+        char *frame = r->frames[r->n_frames++];
+        char prev[LCD_MAX_SIZE + 1], cur[LCD_MAX_SIZE + 1],
+            next[LCD_MAX_SIZE + 1];
+        pos = (i < 35) ? i : 70 - i;
+        snprintf(prev, sizeof(prev), " %s", (pos > 0) ? names[pos - 1] : "");
+        snprintf(cur, sizeof(cur), "-%.*s", LCD_MAX_SIZE - 1, names[pos]);
+        snprintf(next, sizeof(next), " %s", (pos < 39) ? names[pos + 1] : "");
+        if (r->height == 4)
+        {
+            bench_row(r, frame, 0, "Files          00:00");
+            bench_row(r, frame, 1, prev);
+            bench_row(r, frame, 2, cur);
+            bench_row(r, frame, 3, next);
+        } else {
+            bench_row(r, frame, 0, prev);
+            bench_row(r, frame, 1, cur);
+        }
+    }
+}
+
+// Load frames recorded with RPILCD_RECORD: a line naming the screen type,
+// then each row of each frame, exactly the width of the screen, followed by
+// a newline.
+int bench_load(struct recording_t *r, const char *path)
+{
+    char type_name[16];
+    enum lcd_screen_type_t type;
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 1;
+    }
+    if (!fgets(type_name, sizeof(type_name), f))
+    {
+        fclose(f);
+        return 1;
+    }
+    type_name[strcspn(type_name, "\n")] = 0;
+    if (lcd_screen_type_from_name(type_name, &type) != 0)
+    {
+        fprintf(stderr, "%s: unknown screen type %s\n", path, type_name);
+        fclose(f);
+        return 1;
+    }
+    // The dimensions are only known once the screen type is selected.
+    lcd_set_backend("sim");
+    lcd_init(type);
+    bench_init(r, path, type, lcd_width(), lcd_height());
+    lcd_close();
+
+    int row = 0;
+    char line[LCD_MAX_SIZE + 1];
+    while (r->n_frames < BENCH_MAX_FRAMES)
+    {
+        char *frame = r->frames[r->n_frames];
+        for (row = 0; row < r->height; row++)
+        {
+            if (fread(line, 1, r->width + 1, f) != r->width + 1) break;
+            memcpy(frame + row * r->width, line, r->width);
+        }
+        if (row < r->height) break;
+        r->n_frames++;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Replay a recording through a simulated backend and print the results.
+// Returns 0 if the LCD ends up showing the last frame.
+int bench_run(struct recording_t *r, const char *backend)
+{
+    int i = 0, mismatch = 0;
+    struct lcd_stats_t stats;
+    lcd_set_backend(backend);
+    if (lcd_init(r->type) != 0) return 1;
+    hd44780_reset_counters(&hd44780_sim);
+    lcd_reset_stats();
+
+    for (i = 0; i < r->n_frames; i++)
+    {
+        lcd_update(r->frames[i]);
+        // Write every frame rather than letting the writer drop any.
+        lcd_sync();
+    }
+
+    const char *last = r->frames[r->n_frames - 1];
+    for (i = 0; i < r->width * r->height; i++)
+    {
+        if (hd44780_sim.ddram[lcd_pos_to_addr(i)] != (unsigned char)last[i])
+            mismatch++;
+    }
+    lcd_get_stats(&stats);
+    lcd_close();
+
+    unsigned long bytes = stats.bytes ? stats.bytes : 1;
+    printf("%-28s %-5s %6d %8lu %8lu %8lu %8.2f %10.2f %9.1f  %s\n",
+        r->name, backend, r->n_frames, stats.commands, stats.data,
+        hd44780_sim.strobes, (double)hd44780_sim.strobes / bytes,
+        hd44780_sim.bus_ns / 1e6,
+        hd44780_sim.bus_ns / 1e3 / r->n_frames,
+        mismatch ? "MISMATCH" : "ok");
+    return mismatch ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    struct recording_t recordings[4 + argc];
+    int n = 0, i = 0, failed = 0;
+
+    bench_init(&recordings[n], "scroll title 2x16", LCD_2X16, 16, 2);
+    bench_scroll_title(&recordings[n++]);
+    bench_init(&recordings[n], "scroll title 4x20", LCD_4X20, 20, 4);
+    bench_scroll_title(&recordings[n++]);
+    bench_init(&recordings[n], "file list 2x16", LCD_2X16, 16, 2);
+    bench_file_list(&recordings[n++]);
+    bench_init(&recordings[n], "file list 4x20", LCD_4X20, 20, 4);
+    bench_file_list(&recordings[n++]);
+    for (i = 1; i < argc; i++)
+    {
+        if (bench_load(&recordings[n], argv[i]) != 0) return 1;
+        if (recordings[n].n_frames > 0) n++;
+    }
+
+    printf("%-28s %-5s %6s %8s %8s %8s %8s %10s %9s  %s\n",
+        "recording", "bus", "frames", "commands", "chars", "strobes",
+        "str/byte", "bus ms", "us/frame", "DDRAM");
+    for (i = 0; i < n; i++)
+    {
+        failed |= bench_run(&recordings[i], "sim");
+        failed |= bench_run(&recordings[i], "sim8");
+        free(recordings[i].frames);
+    }
+    return failed;
+}
@@ -0,0 +1,218 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+/*
+
+HD44780 LCD on a PCF8574 I2C Backpack
+=====================================
+
+Port Bit            LCD Pin
+P0                  RS
+P1                  RW
+P2                  E
+P3                  Backlight
+P4-P7               D4-D7
+
+Every change to a pin is a write of the whole port, so all the port writes for
+one byte (set up RS, then two E strobes) are sent to the adapter with a single
+write() call.  At 100kHz one byte takes about 0.5ms on the bus, which is far
+longer than the LCD needs to execute an instruction, so the busy flag is never
+read.
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/i2c-dev.h>
+#include "lcd_backend.h"
+#include "hd44780_sim.h"
+
+#define PCF_RS          0x01
+#define PCF_RW          0x02
+#define PCF_E           0x04
+#define PCF_BACKLIGHT   0x08
+
+// Delays no longer than this are covered by the next transfer: even at
+// 400kHz, the address and the first two port writes take 67us on the bus
+// before E falls.  Only clearing the screen and the initialisation sequence
+// need a sleep.
+#define I2C_BUS_DELAY_US    60
+
+#define I2C_DEFAULT_DEVICE  "/dev/i2c-1"
+#define I2C_DEFAULT_ADDRESS 0x27
+
+// File descriptor of the I2C adapter.
+int i2c_fd = -1;
+
+// Send the port writes in buf to the backpack (or to the mock device).
+void (*i2c_transfer)(const unsigned char *buf, int n);
+
+void i2c_delay_us(int us)
+{
+    if (us <= I2C_BUS_DELAY_US) return;
+    struct timespec t;
+    t.tv_sec = us / 1000000;
+    t.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&t, 0);
+}
+
+// Port value with n on D4-D7 and E low.
+unsigned char i2c_port(unsigned char n, int char_mode)
+{
+    return (n << 4) | PCF_BACKLIGHT | (char_mode ? PCF_RS : 0);
+}
+
+// Pack the port writes for one byte: RS and D4-D7 are set up with E low, then
+// E is strobed for each nibble.  Returns the number of port writes.
+int i2c_pack_byte(unsigned char *buf, unsigned char c, int char_mode)
+{
+    unsigned char high = i2c_port(c >> 4, char_mode);
+    unsigned char low = i2c_port(c & 0x0f, char_mode);
+    buf[0] = high;
+    buf[1] = high | PCF_E;
+    buf[2] = high;
+    buf[3] = low | PCF_E;
+    buf[4] = low;
+    return 5;
+}
+
+void i2c_write_nibble(unsigned char n, int char_mode)
+{
+    unsigned char buf[3];
+    unsigned char port = i2c_port(n & 0x0f, char_mode);
+    buf[0] = port;
+    buf[1] = port | PCF_E;
+    buf[2] = port;
+    i2c_transfer(buf, 3);
+}
+
+void i2c_write_byte(unsigned char c, int char_mode)
+{
+    unsigned char buf[5];
+    i2c_transfer(buf, i2c_pack_byte(buf, c, char_mode));
+}
+
+void i2c_write(const unsigned char *buf, int n)
+{
+    if (write(i2c_fd, buf, n) != n)
+        fprintf(stderr, "I2C write failed: %s\n", strerror(errno));
+}
+
+// arg is "device[:address]", for example "/dev/i2c-1:0x27".
+int i2c_init(const char *arg)
+{
+    char device[64];
+    int address = I2C_DEFAULT_ADDRESS;
+    snprintf((char*)&device, sizeof(device), "%s",
+        arg ? arg : I2C_DEFAULT_DEVICE);
+    char *colon = strchr(device, ':');
+    if (colon)
+    {
+        *colon = 0;
+        address = strtol(colon + 1, 0, 0);
+    }
+
+    i2c_fd = open(device, O_RDWR);
+    if (i2c_fd < 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", device, strerror(errno));
+        return 1;
+    }
+    if (ioctl(i2c_fd, I2C_SLAVE, address) < 0)
+    {
+        fprintf(stderr, "Could not select I2C address 0x%02x: %s\n",
+            address, strerror(errno));
+        close(i2c_fd);
+        i2c_fd = -1;
+        return 1;
+    }
+    i2c_transfer = &i2c_write;
+    return 0;
+}
+
+void i2c_close()
+{
+    if (i2c_fd >= 0) close(i2c_fd);
+    i2c_fd = -1;
+}
+
+const struct lcd_backend_t lcd_backend_i2c = {
+    "i2c",
+    4,
+    &i2c_init,
+    &i2c_delay_us,
+    &i2c_write_nibble,
+    &i2c_write_byte,
+    0,
+    &i2c_close,
+    0
+};
+
+/*
+ * Mock PCF8574, for testing the I2C backend without an adapter.  Port writes
+ * are decoded back into E strobes, which drive the HD44780 model, and the
+ * transfers are counted.
+ */
+
+// Last value written to the port.
+unsigned char mock_port;
+
+// Counts of write() transactions, port writes and E strobes seen.
+unsigned long mock_transactions, mock_port_writes, mock_strobes;
+
+void mock_transfer(const unsigned char *buf, int n)
+{
+    int i = 0;
+    mock_transactions++;
+    for (i = 0; i < n; i++)
+    {
+        mock_port_writes++;
+        // The LCD latches D4-D7 on the falling edge of E; RS must not change
+        // while E is high.
+        if ((mock_port & PCF_E) && !(buf[i] & PCF_E))
+        {
+            mock_strobes++;
+            hd44780_strobe(&hd44780_sim, mock_port & 0xf0, mock_port & PCF_RS);
+        }
+        if ((mock_port & PCF_E) && (buf[i] & PCF_E) &&
+                (mock_port & PCF_RS) != (buf[i] & PCF_RS))
+            fprintf(stderr, "i2c-mock: RS changed while E high\n");
+        mock_port = buf[i];
+    }
+    if (mock_port & PCF_E)
+        fprintf(stderr, "i2c-mock: transaction ended with E high\n");
+}
+
+int mock_init(const char *arg)
+{
+    mock_port = 0;
+    mock_transactions = mock_port_writes = mock_strobes = 0;
+    hd44780_reset(&hd44780_sim);
+    i2c_transfer = &mock_transfer;
+    return 0;
+}
+
+void mock_close()
+{
+    fprintf(stderr, "i2c-mock: %lu transactions, %lu port writes, "
+        "%lu strobes\n", mock_transactions, mock_port_writes, mock_strobes);
+}
+
+const struct lcd_backend_t lcd_backend_i2c_mock = {
+    "i2c-mock",
+    4,
+    &mock_init,
+    &i2c_delay_us,
+    &i2c_write_nibble,
+    &i2c_write_byte,
+    0,
+    &mock_close,
+    0
+};
@@ -0,0 +1,169 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+/*
+
+Terminal LCD
+============
+
+The term backend drives the same HD44780 model as the sim backend.  After
+each frame it draws the model's display memory in a box at the top of the
+terminal using ANSI escape sequences, sending only the characters that differ
+from the last drawing.  Drawings are at least TERM_FRAME_US apart: the writer
+thread waits here, and frames published meanwhile are merged into the next
+one.  Everything else written to the terminal scrolls below the box.
+
+*/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hd44780_sim.h"
+#include "lcd_backend.h"
+#include "rpilcd.h"
+
+// Shortest time between drawings (25 per second).
+#define TERM_FRAME_US 40000
+
+// Characters drawn on the terminal, in frame order.
+unsigned char term_screen[LCD_MAX_SIZE];
+
+// When the terminal was last drawn.
+unsigned long long term_drawn_us;
+
+unsigned long long term_time_us()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// UTF-8 for a character of the A00 ROM.  Custom characters are shown as '#',
+// and ROM characters the player does not use as '?'.
+const char *term_char(unsigned char c, char *ascii)
+{
+    if (c < 0x10) return "#";
+    switch (c)
+    {
+    case 0x5c: return "\xc2\xa5";
+    case 0x7e: return "\xe2\x86\x92";
+    case 0x7f: return "\xe2\x86\x90";
+    case 0xa5: return "\xc2\xb7";
+    case 0xdf: return "\xc2\xb0";
+    case 0xe1: return "\xc3\xa4";
+    case 0xe2: return "\xc3\x9f";
+    case 0xe4: return "\xc2\xb5";
+    case 0xee: return "\xc3\xb1";
+    case 0xef: return "\xc3\xb6";
+    case 0xf5: return "\xc3\xbc";
+    case 0xff: return "\xe2\x96\x88";
+    }
+    if (c < 0x20 || c >= 0x80) return "?";
+    ascii[0] = c;
+    ascii[1] = 0;
+    return ascii;
+}
+
+// Draw the characters that have changed since the last drawing.
+void term_draw()
+{
+    // At most a cursor movement and three bytes per character, plus saving
+    // and restoring the cursor.
+    char out[LCD_MAX_SIZE * 16 + 16];
+    char ascii[2];
+    int n = 0, pos = 0, last = -2;
+    n += sprintf(out + n, "\0337");
+    for (pos = 0; pos < lcd_size(); pos++)
+    {
+        unsigned char c = hd44780_sim.ddram[lcd_pos_to_addr(pos)];
+        if (c == term_screen[pos]) continue;
+        term_screen[pos] = c;
+        // Characters next to the last one drawn need no cursor movement.
+        if (pos != last + 1 || pos % lcd_width() == 0)
+        {
+            n += sprintf(out + n, "\033[%d;%dH", pos / lcd_width() + 2,
+                pos % lcd_width() + 2);
+        }
+        n += sprintf(out + n, "%s", term_char(c, ascii));
+        last = pos;
+    }
+    n += sprintf(out + n, "\0338");
+    // Nothing to send if no character changed.
+    if (last >= 0 && write(2, out, n) < 0) return;
+}
+
+int term_init(const char *arg)
+{
+    hd44780_reset(&hd44780_sim);
+    memset(term_screen, ' ', sizeof(term_screen));
+    term_drawn_us = 0;
+
+    // Clear the terminal, draw an empty box and keep the lines below it for
+    // everything else.  The box is no wider than 40 characters or taller
+    // than 4 lines, plus its edges.
+    char out[LCD_MAX_SIZE * 4];
+    int n = sprintf(out, "\033[2J\033[H");
+    int row = 0, i = 0;
+    for (row = -1; row <= lcd_height(); row++)
+    {
+        char edge = (row < 0 || row == lcd_height()) ? '+' : '|';
+        char fill = (edge == '+') ? '-' : ' ';
+        out[n++] = edge;
+        for (i = 0; i < lcd_width(); i++) out[n++] = fill;
+        out[n++] = edge;
+        out[n++] = '\n';
+    }
+    n += sprintf(out + n, "\033[%d;r\033[%d;1H", lcd_height() + 3,
+        lcd_height() + 3);
+    if (write(2, out, n) < 0) return 1;
+    return 0;
+}
+
+void term_delay_us(int us)
+{
+}
+
+void term_write_nibble(unsigned char n, int char_mode)
+{
+    hd44780_strobe(&hd44780_sim, (n & 0x0f) << 4, char_mode);
+}
+
+void term_write_byte(unsigned char c, int char_mode)
+{
+    hd44780_strobe(&hd44780_sim, c & 0xf0, char_mode);
+    hd44780_strobe(&hd44780_sim, c << 4, char_mode);
+}
+
+void term_flushed()
+{
+    unsigned long long now = term_time_us();
+    if (now < term_drawn_us + TERM_FRAME_US)
+    {
+        unsigned long long wait = term_drawn_us + TERM_FRAME_US - now;
+        struct timespec t = { 0, wait * 1000 };
+        nanosleep(&t, 0);
+    }
+    term_draw();
+    term_drawn_us = term_time_us();
+}
+
+void term_close()
+{
+    // Give the whole terminal back to other output.
+    char out[32];
+    int n = sprintf(out, "\033[r\033[%d;1H", lcd_height() + 3);
+    if (write(2, out, n) < 0) return;
+}
+
+const struct lcd_backend_t lcd_backend_term = {
+    "term",
+    4,
+    &term_init,
+    &term_delay_us,
+    &term_write_nibble,
+    &term_write_byte,
+    0,
+    &term_close,
+    &term_flushed
+};
@@ -0,0 +1,557 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+/*
+
+Library Index
+=============
+
+The index is a file holding every directory listing under the root, so the
+FILES screen can be drawn without reading a (slow, freshly mounted) USB
+stick.  It is mapped into memory and used where it is, so loading it costs
+nothing however large it is.
+
+    header        struct library_header_t
+    directories   struct library_dir_t[dirs], in order of path
+    entries       struct library_entry_t[entries], each directory's listing
+                  in dirlist order
+    strings       strings_size bytes of NUL terminated paths and names
+
+Strings are referred to by their offset in the strings.  The file is only
+read by the machine that wrote it, so numbers are in the native byte order.
+
+The index is brought up to date by a thread.  It walks the tree from the
+root, stat'ing each directory.  A directory whose modification time is the
+same as in the index is not read again: adding, removing or renaming an
+entry changes the time.  Only if some directory has changed is a new index
+written, under a temporary name and then renamed over the old one, so a
+power failure leaves either the old or the new index.  The thread maps the
+new file and leaves it in library_pending for the main loop to swap in,
+since the main loop is the only reader of library_current.
+
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "library.h"
+
+#define LIBRARY_MAGIC "RPIL"
+#define LIBRARY_VERSION 1
+
+// Deepest directory indexed.
+#define LIBRARY_MAX_DEPTH 32
+
+struct library_header_t
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t dirs, entries, strings_size;
+    // Absolute path of the root.
+    uint32_t root;
+};
+
+struct library_dir_t
+{
+    uint32_t path;
+    // Entries of the listing.
+    uint32_t first, count;
+    uint32_t pad;
+    // Modification time in nanoseconds.
+    int64_t mtime;
+};
+
+struct library_entry_t
+{
+    uint32_t name;
+    uint32_t type;
+    // Size and modification time of audio files.
+    uint64_t size;
+    int64_t mtime;
+};
+
+// An index file mapped into memory.
+struct library_map_t
+{
+    void *base;
+    size_t size;
+    const struct library_header_t *header;
+    const struct library_dir_t *dirs;
+    const struct library_entry_t *entries;
+    const char *strings;
+};
+
+// Device and inode of a directory, identifying it whatever path it was
+// reached by.
+struct library_file_id_t
+{
+    dev_t dev;
+    ino_t ino;
+};
+
+// An index being made by the thread.
+struct library_build_t
+{
+    struct library_dir_t *dirs;
+    int dir_count, dir_size;
+    struct library_entry_t *entries;
+    int entry_count, entry_size;
+    char *strings;
+    int strings_len, strings_size;
+    // Directories scanned so far, sorted by device and inode.
+    struct library_file_id_t *visited;
+    int visited_count, visited_size;
+    // Set if any directory differs from the old index.
+    int changed;
+};
+
+// The index used by library_list, and a newer one waiting to replace it.
+struct library_map_t *library_current;
+struct library_map_t *library_pending;
+
+char *library_file;
+char *library_root;
+// Absolute path of the root, to check an index was made for it.
+char *library_root_path;
+
+pthread_t library_pthread;
+int library_started;
+// Set to stop the thread.
+int library_stop;
+
+// Strings of the index being sorted by library_dir_cmp.
+const char *library_sort_strings;
+
+int64_t library_mtime(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+void library_unmap(struct library_map_t *m)
+{
+    if (!m) return;
+    munmap(m->base, m->size);
+    free(m);
+}
+
+// Return 1 if a file or directory belongs to the user running the player
+// and no one else can write to it.  The player runs as root to reach the
+// GPIO registers, and the index is mapped and used where it is, so a file
+// another user could change after it was checked must not be used.
+int library_private(const struct stat *st)
+{
+    return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// Map an index file, checking that every offset in it is in range.
+// Returns 0 if the file is missing, damaged, for another root or not
+// private to the user.
+struct library_map_t *library_map(const char *file, const char *root)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return 0;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) != 0) st.st_size = 0;
+    else if (!S_ISREG(st.st_mode) || !library_private(&st))
+    {
+        fprintf(stderr, "Ignoring library index %s: it is not a file only "
+            "this user can write to\n", file);
+        st.st_size = 0;
+    }
+    if (st.st_size >= sizeof(struct library_header_t))
+        base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return 0;
+
+    struct library_map_t *m = malloc(sizeof(*m));
+    if (!m)
+    {
+        munmap(base, st.st_size);
+        return 0;
+    }
+    m->base = base;
+    m->size = st.st_size;
+    m->header = base;
+    m->dirs = (const void*)(m->header + 1);
+    m->entries = (const void*)(m->dirs + m->header->dirs);
+    m->strings = (const void*)(m->entries + m->header->entries);
+
+    const struct library_header_t *h = m->header;
+    uint64_t size = sizeof(*h) + (uint64_t)h->dirs * sizeof(*m->dirs) +
+        (uint64_t)h->entries * sizeof(*m->entries) + h->strings_size;
+    int ok = memcmp(h->magic, LIBRARY_MAGIC, 4) == 0 &&
+        h->version == LIBRARY_VERSION && size == m->size &&
+        h->strings_size > 0 && m->strings[h->strings_size - 1] == 0 &&
+        h->root < h->strings_size && strcmp(m->strings + h->root, root) == 0;
+    uint32_t i = 0;
+    for (i = 0; ok && i < h->dirs; i++)
+    {
+        ok = m->dirs[i].path < h->strings_size &&
+            (uint64_t)m->dirs[i].first + m->dirs[i].count <= h->entries;
+    }
+    for (i = 0; ok && i < h->entries; i++)
+    {
+        ok = m->entries[i].name < h->strings_size &&
+            m->entries[i].type <= DIRLIST_AUDIO;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "Ignoring library index %s\n", file);
+        library_unmap(m);
+        return 0;
+    }
+    return m;
+}
+
+// Find a directory in an index.
+const struct library_dir_t *library_find(const struct library_map_t *m,
+    const char *path)
+{
+    int lo = 0, hi = m->header->dirs;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(path, m->strings + m->dirs[mid].path);
+        if (c == 0) return &m->dirs[mid];
+        if (c < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return 0;
+}
+
+// Make room for one more item in an array of the index being built.
+int library_grow(void **items, int *size, int count, size_t item_size)
+{
+    if (count < *size) return 0;
+    int new_size = *size ? *size * 2 : 256;
+    void *p = realloc(*items, new_size * item_size);
+    if (!p) return 1;
+    *items = p;
+    *size = new_size;
+    return 0;
+}
+
+// Add a string to the index being built.  Returns its offset, or -1 if out
+// of memory.
+int library_add_string(struct library_build_t *b, const char *s)
+{
+    int len = strlen(s) + 1;
+    while (b->strings_len + len > b->strings_size)
+    {
+        int size = b->strings_size ? b->strings_size * 2 : 4096;
+        char *p = realloc(b->strings, size);
+        if (!p) return -1;
+        b->strings = p;
+        b->strings_size = size;
+    }
+    memcpy(b->strings + b->strings_len, s, len);
+    b->strings_len += len;
+    return b->strings_len - len;
+}
+
+int library_add_entry(struct library_build_t *b, const char *name,
+    uint32_t type, uint64_t size, int64_t mtime)
+{
+    int offset = library_add_string(b, name);
+    if (offset < 0 || library_grow((void**)&b->entries, &b->entry_size,
+        b->entry_count, sizeof(*b->entries)) != 0) return 1;
+    struct library_entry_t *e = &b->entries[b->entry_count++];
+    e->name = offset;
+    e->type = type;
+    e->size = size;
+    e->mtime = mtime;
+    return 0;
+}
+
+// Record that a directory is being scanned.  Returns 0 the first time,
+// 1 if it has been scanned already (through a symbolic link) and -1 if out
+// of memory.
+int library_visit(struct library_build_t *b, const struct stat *st)
+{
+    int lo = 0, hi = b->visited_count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        const struct library_file_id_t *v = &b->visited[mid];
+        if (v->dev == st->st_dev && v->ino == st->st_ino) return 1;
+        if (v->dev < st->st_dev ||
+            (v->dev == st->st_dev && v->ino < st->st_ino)) lo = mid + 1;
+        else hi = mid;
+    }
+    if (library_grow((void**)&b->visited, &b->visited_size,
+        b->visited_count, sizeof(*b->visited)) != 0) return -1;
+    memmove(&b->visited[lo + 1], &b->visited[lo],
+        (b->visited_count - lo) * sizeof(*b->visited));
+    b->visited[lo].dev = st->st_dev;
+    b->visited[lo].ino = st->st_ino;
+    b->visited_count++;
+    return 0;
+}
+
+// Add the listing of a directory, and of each directory below it, to the
+// index being built, reading only directories that have changed since the
+// old index was made.  A directory reached again through a symbolic link is
+// left out, so links that loop are not followed forever; it is read when
+// it is visited instead.
+int library_scan(struct library_build_t *b, const struct library_map_t *old,
+    const char *path, int depth)
+{
+    struct stat st;
+    if (__atomic_load_n(&library_stop, __ATOMIC_RELAXED)) return 1;
+    if (depth > LIBRARY_MAX_DEPTH || stat(path, &st) != 0) return 0;
+    int seen = library_visit(b, &st);
+    if (seen != 0) return seen < 0;
+
+    int first = b->entry_count;
+    const struct library_dir_t *od = old ? library_find(old, path) : 0;
+    if (od && od->mtime == library_mtime(&st))
+    {
+        uint32_t i = 0;
+        for (i = od->first; i < od->first + od->count; i++)
+        {
+            const struct library_entry_t *e = &old->entries[i];
+            if (library_add_entry(b, old->strings + e->name, e->type,
+                e->size, e->mtime) != 0) return 1;
+        }
+    } else {
+        b->changed = 1;
+        struct dirlist_t list;
+        dirlist_read(&list, path, 0);
+        int i = 0;
+        for (i = 0; i < list.count; i++)
+        {
+            // Only files need stat'ing; directories are stat'ed when they
+            // are scanned.
+            struct stat fst;
+            char file[PATH_MAX];
+            uint64_t size = 0;
+            int64_t mtime = 0;
+            if (list.entries[i].type == DIRLIST_AUDIO &&
+                snprintf(file, sizeof(file), "%s/%s", path,
+                    dirlist_name(&list, i)) < sizeof(file) &&
+                stat(file, &fst) == 0)
+            {
+                size = fst.st_size;
+                mtime = library_mtime(&fst);
+            }
+            if (library_add_entry(b, dirlist_name(&list, i),
+                list.entries[i].type, size, mtime) != 0)
+            {
+                dirlist_free(&list);
+                return 1;
+            }
+        }
+        dirlist_free(&list);
+    }
+
+    int offset = library_add_string(b, path);
+    if (offset < 0 || library_grow((void**)&b->dirs, &b->dir_size,
+        b->dir_count, sizeof(*b->dirs)) != 0) return 1;
+    struct library_dir_t *d = &b->dirs[b->dir_count++];
+    d->path = offset;
+    d->first = first;
+    d->count = b->entry_count - first;
+    d->pad = 0;
+    d->mtime = library_mtime(&st);
+
+    // The arrays move as the subdirectories are added, so look each entry up
+    // again.
+    int i = 0, count = b->entry_count - first;
+    for (i = 0; i < count; i++)
+    {
+        const struct library_entry_t *e = &b->entries[first + i];
+        const char *name = b->strings + e->name;
+        if (e->type != DIRLIST_DIR || strcmp(name, ".") == 0 ||
+            strcmp(name, "..") == 0) continue;
+        char sub[PATH_MAX];
+        if (snprintf(sub, sizeof(sub), "%s/%s", path, name) >= sizeof(sub))
+            continue;
+        if (library_scan(b, old, sub, depth + 1) != 0) return 1;
+    }
+    return 0;
+}
+
+int library_dir_cmp(const void *a, const void *b)
+{
+    const struct library_dir_t *d1 = a, *d2 = b;
+    return strcmp(library_sort_strings + d1->path,
+        library_sort_strings + d2->path);
+}
+
+// Write the index built by the thread.
+int library_write(struct library_build_t *b)
+{
+    library_sort_strings = b->strings;
+    qsort(b->dirs, b->dir_count, sizeof(*b->dirs), &library_dir_cmp);
+
+    struct library_header_t h;
+    memcpy(h.magic, LIBRARY_MAGIC, 4);
+    h.version = LIBRARY_VERSION;
+    h.dirs = b->dir_count;
+    h.entries = b->entry_count;
+    int root = library_add_string(b, library_root_path);
+    if (root < 0) return 1;
+    h.root = root;
+    h.strings_size = b->strings_len;
+
+    // The temporary file is made next to the index, with a name no one
+    // else can guess or have made already.
+    char *tmp = malloc(strlen(library_file) + 8);
+    if (!tmp) return 1;
+    sprintf(tmp, "%s.XXXXXX", library_file);
+    int fd = mkstemp(tmp);
+    FILE *f = (fd < 0) ? 0 : fdopen(fd, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Could not write library index %s\n", tmp);
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
+        return 1;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+        fwrite(b->dirs, sizeof(*b->dirs), b->dir_count, f) == b->dir_count &&
+        fwrite(b->entries, sizeof(*b->entries), b->entry_count, f) ==
+            b->entry_count &&
+        fwrite(b->strings, 1, b->strings_len, f) == b->strings_len &&
+        fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok && rename(tmp, library_file) == 0;
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write library index %s\n", library_file);
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok ? 0 : 1;
+}
+
+void *library_thread(void *arg)
+{
+    // The thread has its own mapping of the old index, so the main loop can
+    // swap its mapping at any time.
+    struct library_map_t *old = library_map(library_file, library_root_path);
+    struct library_build_t b;
+    memset(&b, 0, sizeof(b));
+    int failed = library_scan(&b, old, library_root, 0);
+    if (!failed && (b.changed || !old || old->header->dirs != b.dir_count))
+    {
+        fprintf(stderr, "Library: indexed %d directories, %d entries\n",
+            b.dir_count, b.entry_count);
+        if (library_write(&b) == 0)
+        {
+            struct library_map_t *m =
+                library_map(library_file, library_root_path);
+            if (m) __atomic_store_n(&library_pending, m, __ATOMIC_RELEASE);
+        }
+    }
+    library_unmap(old);
+    free(b.dirs);
+    free(b.entries);
+    free(b.strings);
+    free(b.visited);
+    return 0;
+}
+
+// Make the directory of the default index, private to the user.  Returns 0
+// if it is there and no one else can change what is in it.
+int library_make_dir(const char *dir)
+{
+    struct stat st;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Could not make %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || !library_private(&st))
+    {
+        fprintf(stderr, "Not using the library index in %s: it is not a "
+            "directory only this user can write to\n", dir);
+        return 1;
+    }
+    return 0;
+}
+
+int library_open(const char *file, const char *root)
+{
+    if (strcmp(file, LIBRARY_DEFAULT_FILE) == 0 &&
+        library_make_dir(LIBRARY_DEFAULT_DIR) != 0) return 1;
+    char path[PATH_MAX];
+    if (!realpath(root, path))
+    {
+        fprintf(stderr, "Could not index %s\n", root);
+        return 1;
+    }
+    library_file = strdup(file);
+    library_root = strdup(root);
+    library_root_path = strdup(path);
+    library_current = library_map(file, path);
+    library_stop = 0;
+    if (pthread_create(&library_pthread, 0, &library_thread, 0) != 0)
+    {
+        fprintf(stderr, "Could not start library thread\n");
+        return 1;
+    }
+    library_started = 1;
+    return 0;
+}
+
+int library_list(struct dirlist_t *list, const char *path, int flags,
+    long long mtime)
+{
+    memset(list, 0, sizeof(*list));
+
+    struct library_map_t *m =
+        __atomic_exchange_n(&library_pending, 0, __ATOMIC_ACQUIRE);
+    if (m)
+    {
+        library_unmap(library_current);
+        library_current = m;
+    }
+    if (!library_current) return 1;
+
+    const struct library_dir_t *d = library_find(library_current, path);
+    if (!d || d->mtime != mtime) return 1;
+    uint32_t i = 0;
+    for (i = d->first; i < d->first + d->count; i++)
+    {
+        const struct library_entry_t *e = &library_current->entries[i];
+        if ((flags & DIRLIST_AUDIO_ONLY) && e->type != DIRLIST_AUDIO)
+            continue;
+        // A partial listing would be shown and cached as if complete.
+        if (dirlist_add(list, e->type, library_current->strings + e->name))
+        {
+            dirlist_free(list);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void library_close()
+{
+    if (library_started)
+    {
+        __atomic_store_n(&library_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(library_pthread, 0);
+        library_started = 0;
+    }
+    library_unmap(library_current);
+    library_unmap(__atomic_exchange_n(&library_pending, 0, __ATOMIC_ACQUIRE));
+    library_current = 0;
+    free(library_file);
+    free(library_root);
+    free(library_root_path);
+    library_file = library_root = library_root_path = 0;
+}
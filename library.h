@@ -0,0 +1,50 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+#include "dirlist.h"
+
+/*!
+ * Index file used unless another is given with -i, and the directory that
+ * holds it.  The directory is made by library_open, private to the user
+ * running the player.
+ */
+#define LIBRARY_DEFAULT_DIR "/tmp/rpilcd"
+#define LIBRARY_DEFAULT_FILE LIBRARY_DEFAULT_DIR "/library.index"
+
+/*!
+ * Load the index of the directory tree under root from a file, if the file
+ * exists, was made for the same directory and belongs to the user running
+ * the player with no one else able to write to it, and start a thread that
+ * brings the index up to date.  The thread stats every directory, reads
+ * those whose modification time has changed and, if anything has, writes a
+ * new index file and passes it to library_list.
+ * \param root The directory, as it starts the paths passed to library_list
+ * (for example ".").
+ * \return 0 if the thread was started, 1 otherwise.
+ */
+int library_open(const char *file, const char *root);
+
+/*!
+ * List a directory from the index, without reading it.  Only called from
+ * the main loop.
+ * \param flags DIRLIST_AUDIO_ONLY or 0, as for dirlist_read.
+ * \param mtime The directory's modification time now, as returned by
+ * dirlist_mtime.  The index is not used if it was made when the directory
+ * had another time.
+ * \return 0 if the directory was in the index, 1 if it was not, has
+ * changed since or could not be listed for lack of memory, in which case
+ * the list is empty and should be read with dirlist_read.
+ */
+int library_list(struct dirlist_t *list, const char *path, int flags,
+    long long mtime);
+
+/*!
+ * Stop the thread updating the index and unload the index.
+ */
+void library_close();
+
+#endif
@@ -3,18 +3,37 @@
  * Copyright (C) 2014 James Goode.
  */
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "SDL/SDL.h"
 #include "SDL/SDL_mixer.h"
 #include "rpilcd.h"
+#include "button.h"
+#include "input_queue.h"
+#include "timer_wheel.h"
+#include "screen.h"
+#include "title.h"
+#include "dirlist.h"
+#include "library.h"
 #include "play.h"
 
+// Interval between scans when the buttons are polled: while a button is held
+// or settling, so that debouncing, long presses and repeats are timed
+// closely, and while all the buttons are idle.
+#define BUTTON_POLL_MILLIS 10
+#define BUTTON_IDLE_POLL_MILLIS 50
+
+// Type of LCD used unless another is given with -l.
 #define LCD_BUTTON_PLAY_LCD_TYPE LCD_2X16
 
-#define POSITION_STRING_LEN 5
+// Time each step of the scroll animation is shown for.
+#define SCROLL_STEP_NS 350000000ULL
 
 #ifdef SIMULATE_LCD
 #define DELAY_MILLIS(millis) SDL_Delay(millis)
@@ -22,118 +41,270 @@
 #define DELAY_MILLIS(millis) bcm2835_delay(millis)
 #endif
 
+// Draws the screen for each mode.
+struct screen_t screen;
+
+// Incremented when the directory list is replaced, so the screen knows to
+// draw it again.
+unsigned int list_gen;
+
 int volume_level[] = {
     0, 5, 10, 17, 25, 34, 45, 55, 65, 76, 88, 100, 112, 128 };
 
 char **directory_path;
-struct dirent ***directory_list;
-int *directory_list_size;
+// Entries of the directory shown on the FILES screen.
+struct dirlist_t directory_list;
+// Reads the directory in the background when it is not in the library
+// index; directory_loading is set until every entry is in directory_list.
+// directory_incomplete is set if directory_list is missing entries that
+// could not be read.
+struct dirlist_loader_t directory_loader;
+int directory_loading, directory_incomplete;
+// Modification time of the directory when directory_list was made.
+long long directory_mtime;
+// Directories visited recently, with the cursor where it was left.
+struct dirlist_cache_t directory_cache;
 int *directory_list_position;
 
-// Mutex for access to directory variables.
-pthread_mutex_t *directory_mutex;
-
-pthread_t next_track_pthread;
-
 // The playlist (not including the track currently playing).
 struct playlist_t **playlist;
 
-// Mutex for access to the playlist.
-pthread_mutex_t *playlist_mutex;
-
-// Mutex signalling that the next track in the queue should be played.
-pthread_mutex_t *next_track_mutex;
-
 // SDL_mixer data for the track currently playing.
 Mix_Music *mus;
 
 // The current volume.
 int volume;
 
-// Global variable containing last button press.
-enum button_press_t *button_press;
-
-// Mutex for access to global button_press.
-pthread_mutex_t *button_press_mutex;
-
-// Mutex signalling that a button press has been made.
-pthread_mutex_t *button_press_sig;
+// Button presses waiting for the main loop.
+struct input_queue_t input_queue;
 
 // Pthread monitoring button presses (possibly simulated).
 pthread_t button_press_pthread;
 
-// Current state of the player (stopped, paused, playing).
-enum player_state_t *player_state;
+// GPIO character device to read the buttons from (set with -g), or null to
+// poll the pins with the bcm2835 library.
+#ifdef SIMULATE_LCD
+const char *button_chip = 0;
+#else
+const char *button_chip = "/dev/gpiochip0";
+#endif
 
-// Current display mode.
-enum mode_t *player_state_mode;
+// Current state of the player, shared with SDL's audio thread.
+struct player_t player;
 
-// The title of the current track (to be displayed on the now playing screen).
-char **player_state_title;
+// Set when the screen needs to be drawn again; the main loop draws it once it
+// has handled the events that woke it.
+int redraw_pending;
 
-// The current position in the track.
-int *player_state_position;
+// eventfd written by SDL's threads when audio_events has new bits set.
+int audio_fd = -1;
 
-// The current position in the track in seconds.
-int *player_state_position_seconds;
+// AUDIO_* bits for the main loop, set by SDL's threads.
+unsigned int audio_events;
 
-// Scroll position for long titles.
-int *player_state_scroll_pos;
+// Timers for the scroll animation and the clock (TIMER_*).
+struct timer_wheel_t timers;
 
-// Mutex for access to player_state and player_state_title.
-pthread_mutex_t *player_state_mutex;
+// Number of times the main loop has woken up and drawn the screen.
+unsigned long loop_wakeups, redraws;
 
-// Signal for the screen to redraw
-pthread_mutex_t *redraw_sig;
+void request_redraw()
+{
+    redraw_pending = 1;
+}
 
-// Thread to redraw the screen when redraw_sig is signalled.
-pthread_t redraw_pthread;
+void notify_audio(unsigned int events)
+{
+    __atomic_fetch_or(&audio_events, events, __ATOMIC_RELEASE);
+    uint64_t v = 1;
+    ssize_t r = write(audio_fd, &v, sizeof(v));
+    (void)r;
+}
 
-// Thread to scroll text too big to fit on the screen.
-pthread_t scroll_pthread;
+void player_write_begin()
+{
+    // Writers take turns by moving the count from even to odd.
+    unsigned int seq = __atomic_load_n(&player.seq, __ATOMIC_RELAXED);
+    while ((seq & 1) || !__atomic_compare_exchange_n(&player.seq, &seq,
+            seq + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        seq = __atomic_load_n(&player.seq, __ATOMIC_RELAXED);
+    // Readers must not see the new fields before the odd count.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void player_write_end()
+{
+    __atomic_store_n(&player.seq, player.seq + 1, __ATOMIC_RELEASE);
+}
+
+void player_snapshot(struct player_t *s)
+{
+    unsigned int seq;
+    do
+    {
+        seq = __atomic_load_n(&player.seq, __ATOMIC_ACQUIRE);
+        s->state = __atomic_load_n(&player.state, __ATOMIC_RELAXED);
+        s->mode = __atomic_load_n(&player.mode, __ATOMIC_RELAXED);
+        s->scroll_pos = __atomic_load_n(&player.scroll_pos, __ATOMIC_RELAXED);
+        s->title = __atomic_load_n(&player.title, __ATOMIC_RELAXED);
+        s->title_gen = __atomic_load_n(&player.title_gen, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // Try again if a writer was busy or finished while copying.
+    } while ((seq & 1) ||
+        __atomic_load_n(&player.seq, __ATOMIC_RELAXED) != seq);
+    s->seq = seq;
+    s->position = player_position();
+    s->position_seconds = s->position / (PLAY_SAMPLERATE * 4);
+}
+
+int player_position()
+{
+    unsigned int seq;
+    int position, seek;
+    do
+    {
+        seq = __atomic_load_n(&player.position_seq, __ATOMIC_ACQUIRE);
+        position = __atomic_load_n(&player.position, __ATOMIC_RELAXED);
+        seek = __atomic_load_n(&player.seek, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+        __atomic_load_n(&player.position_seq, __ATOMIC_RELAXED) != seq);
+    return (seek & PLAYER_SEEK_TO) ? (seek & ~3) : position + seek;
+}
+
+int player_position_seconds()
+{
+    // There are two bytes per sample per channel and two channels.
+    return player_position() / (PLAY_SAMPLERATE * 4);
+}
+
+// Store the position and the position in seconds; only called by the audio
+// thread.
+void player_store_position(int position)
+{
+    __atomic_store_n(&player.position, position, __ATOMIC_RELAXED);
+    // Divide by 4 because the position is the number of bytes, there are two
+    // bytes per sample per channel and two channels.
+    __atomic_store_n(&player.position_seconds,
+        (position / PLAY_SAMPLERATE) / 4, __ATOMIC_RELAXED);
+}
+
+// Combine a seek with any the audio thread has not applied yet.  A move
+// after a position to set moves that position.
+void player_seek(int bytes, int to)
+{
+    int seek = __atomic_load_n(&player.seek, __ATOMIC_RELAXED), next;
+    do
+    {
+        if (to) next = (bytes & ~3) | PLAYER_SEEK_TO;
+        else next = ((seek & ~3) + (bytes & ~3)) | (seek & PLAYER_SEEK_TO);
+    } while (!__atomic_compare_exchange_n(&player.seek, &seek, next, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void player_set_position(int position)
+{
+    player_seek(position, 1);
+}
+
+void player_move_position(int bytes)
+{
+    player_seek(bytes, 0);
+}
+
+void player_set_state(enum player_state_t state)
+{
+    player_write_begin();
+    __atomic_store_n(&player.state, state, __ATOMIC_RELAXED);
+    player_write_end();
+}
+
+void player_set_scroll_pos(int scroll_pos)
+{
+    player_write_begin();
+    __atomic_store_n(&player.scroll_pos, scroll_pos, __ATOMIC_RELAXED);
+    player_write_end();
+}
 
 void music_length_callback(void *udata, Uint8 *stream, int len)
 {
-    pthread_mutex_lock(player_state_mutex);
-    if(Mix_PlayingMusic() && !Mix_PausedMusic()) *player_state_position += len;
-    // Divide by 4 because len is the number of bytes, there are two bytes per
-    // sample per channel and two channels.
-    if(*player_state_position_seconds !=
-            (*player_state_position/PLAY_SAMPLERATE) / 4)
+    // Apply any seek the main loop asked for, then count what is played.
+    // The main loop's clock timer redraws the screen as the position moves.
+    int playing = Mix_PlayingMusic() && !Mix_PausedMusic();
+    if (!playing && __atomic_load_n(&player.seek, __ATOMIC_RELAXED) == 0)
+        return;
+    unsigned int seq = player.position_seq;
+    __atomic_store_n(&player.position_seq, seq + 1, __ATOMIC_RELAXED);
+    // Readers must not see the new position before the odd count.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    int seek = __atomic_exchange_n(&player.seek, 0, __ATOMIC_ACQUIRE);
+    int position = player.position;
+    if (seek & PLAYER_SEEK_TO) position = seek & ~3;
+    else position += seek;
+    if (playing) position += len;
+    player_store_position(position);
+    __atomic_store_n(&player.position_seq, seq + 2, __ATOMIC_RELEASE);
+    if (seek) notify_audio(AUDIO_SEEKED);
+}
+
+void music_finished()
+{
+    // SDL_mixer functions must not be called from this hook, so leave
+    // starting the next track to the main loop.
+    notify_audio(AUDIO_FINISHED);
+}
+
+void redraw()
+{
+    redraws++;
+    struct player_t p;
+    player_snapshot(&p);
+    struct screen_state_t st;
+    st.mode = p.mode;
+    st.state = p.state;
+    st.position_seconds = p.position_seconds;
+    st.title = p.title;
+    st.title_gen = p.title_gen;
+    st.list_gen = list_gen;
+    st.loading = directory_loading ? directory_list.count : -1;
+    st.scroll_pos = p.scroll_pos;
+    st.volume = volume;
+    int i = 0;
+    for (i = 0; i < 3; i++)
     {
-        *player_state_position_seconds =
-            (*player_state_position/PLAY_SAMPLERATE) / 4;
-        pthread_mutex_unlock(redraw_sig);
+        int pos = *directory_list_position + i - 1;
+        st.entry[i] = (pos >= 0 && pos < directory_list.count) ?
+            dirlist_title(&directory_list, pos) : 0;
     }
-    pthread_mutex_unlock(player_state_mutex);
+    screen_render(&screen, &st);
+    update_timers();
 }
 
-void *redraw_thread(void* v)
+void update_timers()
 {
-    while (1)
+    unsigned long long now = timer_now_ns();
+
+    // Scroll only while something on the screen is too long for it.
+    if (screen.scroll_steps == 0)
     {
-        pthread_mutex_lock(redraw_sig);
-        // Redraw the screen
-        pthread_mutex_lock(player_state_mutex);
-        enum mode_t mode = *player_state_mode;
-        pthread_mutex_unlock(player_state_mutex);
-        switch (mode)
-        {
-            case NOW:
-            draw_now_playing();
-            break;
-            case VOL:
-            draw_vol();
-            break;
-            case FILES:
-            draw_directory_list();
-            break;
-        }
-#ifdef SIMULATE_LCD
-        SDL_Delay(30);
-#else
-        DELAY_MILLIS(30);
-#endif
+        timer_wheel_cancel(&timers, TIMER_SCROLL);
+        if (player.scroll_pos != 0) player_set_scroll_pos(0);
+    } else if (!timer_wheel_armed(&timers, TIMER_SCROLL))
+    {
+        timer_wheel_arm(&timers, TIMER_SCROLL, now + SCROLL_STEP_NS);
+    }
+
+    // Tick the clock only while it is shown and moving, just after the
+    // position reaches the next whole second.
+    if (screen.clock_shown && player.state == PLAYING)
+    {
+        const unsigned long long bytes_per_second = PLAY_SAMPLERATE * 4;
+        unsigned long long left = bytes_per_second -
+            player_position() % bytes_per_second;
+        timer_wheel_arm(&timers, TIMER_CLOCK,
+            now + left * 1000000000ULL / bytes_per_second + 1000000);
+    } else {
+        timer_wheel_cancel(&timers, TIMER_CLOCK);
     }
 }
 
@@ -157,18 +328,20 @@ void play_music(const char* path)
 
 void queue_next()
 {
-    pthread_mutex_lock(playlist_mutex);
     Mix_HaltMusic();
     // If there are no more tracks to play, set the player state to STOPPED.
     if(!(*playlist))
     {
         fprintf(stderr, "No more tracks in playlist\n");
         // Change the player state.
-        pthread_mutex_lock(player_state_mutex);
-        *player_state = STOPPED;
-        free(*player_state_title);
-        *player_state_title = 0;
-        pthread_mutex_unlock(player_state_mutex);
+        struct title_t *title = player.title;
+        player_write_begin();
+        __atomic_store_n(&player.state, STOPPED, __ATOMIC_RELAXED);
+        __atomic_store_n(&player.title, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&player.title_gen, player.title_gen + 1,
+            __ATOMIC_RELAXED);
+        player_write_end();
+        free(title);
     }
     // Queue the next track.
     else if((*playlist))
@@ -176,49 +349,30 @@ void queue_next()
         // Send the track to SDL_mixer.
         fprintf(stderr, "Playing %s\n", (*playlist)->path);
         play_music((*playlist)->path);
-        // Note the current state.
-        pthread_mutex_lock(player_state_mutex);
-        if(*player_state_title != 0) free(*player_state_title);
-        *player_state_title = strdup((*playlist)->title);
-        *player_state = PLAYING;
-        // Reset the timer.
-        *player_state_position = 0;
-        *player_state_position_seconds = 0;
-        pthread_mutex_unlock(player_state_mutex);
+        // Note the current state and reset the timer.
+        // The playlist entry's title moves to the player.
+        struct title_t *title = player.title;
+        player_write_begin();
+        __atomic_store_n(&player.title, (*playlist)->title, __ATOMIC_RELAXED);
+        __atomic_store_n(&player.title_gen, player.title_gen + 1,
+            __ATOMIC_RELAXED);
+        __atomic_store_n(&player.state, PLAYING, __ATOMIC_RELAXED);
+        player_write_end();
+        player_set_position(0);
+        free(title);
         // Remove this song from the playlist.
         struct playlist_t *n2 = (*playlist)->next;
         free((*playlist)->path);
-        free((*playlist)->title);
         free((*playlist));
         (*playlist) = n2;
     }
-
-    pthread_mutex_unlock(playlist_mutex);
-}
-
-void *next_track_thread(void *v)
-{
-    while (1)
-    {
-        // Wait for a new track to become available
-        pthread_mutex_lock(next_track_mutex);
-        // Queue the track
-        fprintf(stderr, "Queue a track\n");
-        queue_next();
-    }
-}
-
-void continue_queue()
-{
-    fprintf(stderr, "continue_queue\n");
-    pthread_mutex_unlock(next_track_mutex);
 }
 
 void append_to_playlist(const char* path, const char *title)
 {
     struct playlist_t *n = malloc(sizeof(struct playlist_t));
     n->path = strdup(path);
-    n->title = strdup(title);
+    n->title = title_new(title, TITLE_STRIP_EXTENSION);
     n->next = 0;
 
     if(*playlist)
@@ -233,117 +387,79 @@ void append_to_playlist(const char* path, const char *title)
     }
 }
 
-int wdstat(const char* filename, struct stat *buf)
-{
-    if(filename == 0 || buf == 0)
-    {
-        return -1;
-    }
-    char *path =
-        malloc(strlen(*directory_path) + strlen(filename) + 2);
-    sprintf(path, "%s/%s", *directory_path, filename);
-    int s = stat(path, buf);
-    free(path);
-    return s;
-}
-
 void free_directory_list()
 {
-    pthread_mutex_lock(directory_mutex);
+    dirlist_load_cancel(&directory_loader);
     if(*directory_path)
     {
-        free(*directory_path);
-        *directory_path = 0;
-    }
-    if(*directory_list)
-    {
-        int i = 0;
-        for (i = 0; i < *directory_list_size; i++)
+        // Keep the list, unless it is only partly read, for coming back to
+        // the directory.
+        if (!directory_loading && !directory_incomplete)
         {
-            free((*directory_list)[i]);
+            dirlist_cache_put(&directory_cache, *directory_path,
+                directory_mtime, &directory_list, *directory_list_position);
         }
-        free(*directory_list);
-        *directory_list = 0;
-        *directory_list_size = -1;
-    }
-    pthread_mutex_unlock(directory_mutex);
-}
-
-int is_mp3(const struct dirent *d1)
-{
-    struct stat d1_stat;
-    wdstat(d1->d_name, &d1_stat);
-
-    return (S_ISREG(d1_stat.st_mode) && strlen(d1->d_name) >= 4 &&
-        (strcmp((char*)(d1->d_name + strlen(d1->d_name) - 4), ".mp3") == 0 ||
-        strcmp((char*)(d1->d_name + strlen(d1->d_name) - 4), ".ogg") == 0)
-        )?1:0;
-}
-
-int is_mp3_or_dir(const struct dirent *d1)
-{
-    struct stat d1_stat;
-    wdstat(d1->d_name, &d1_stat);
-
-    if(S_ISDIR(d1_stat.st_mode) &&
-        (d1->d_name[0] != '.' ||
-        (strcmp(d1->d_name, "..") == 0 || strcmp(d1->d_name, ".") == 0)))
-        return 1;
-
-    return (S_ISREG(d1_stat.st_mode) && strlen(d1->d_name) >= 4 &&
-        (strcmp((char*)(d1->d_name + strlen(d1->d_name) - 4), ".mp3") == 0 ||
-        strcmp((char*)(d1->d_name + strlen(d1->d_name) - 4), ".ogg") == 0)
-        )?1:0;
-}
-
-int dirname_cmp(const struct dirent **d1, const struct dirent **d2)
-{
-    struct stat d1_stat, d2_stat;
-    wdstat((*d1)->d_name, &d1_stat);
-    wdstat((*d2)->d_name, &d2_stat);
-
-    if( (S_ISDIR(d1_stat.st_mode) && S_ISDIR(d2_stat.st_mode))
-      || (S_ISREG(d1_stat.st_mode) && S_ISREG(d2_stat.st_mode)) )
-    {
-        return strcmp((*d1)->d_name, (*d2)->d_name);
-    } else
-    if(S_ISDIR(d1_stat.st_mode) && S_ISREG(d2_stat.st_mode))
-    {
-        return -1;
-    } else
-    if(S_ISREG(d2_stat.st_mode) && S_ISDIR(d2_stat.st_mode))
-    {
-        return 1;
+        free(*directory_path);
+        *directory_path = 0;
     }
+    directory_loading = directory_incomplete = 0;
+    dirlist_free(&directory_list);
+    list_gen++;
 }
 
 void change_directory(const char* directory)
 {
     free_directory_list();
 
-    pthread_mutex_lock(directory_mutex);
     *directory_path = strdup(directory);
     *directory_list_position = 0;
 
-    int n = scandir(directory, directory_list, &is_mp3_or_dir, &dirname_cmp);
+    // Directories visited recently are shown as they were left, if they have
+    // not changed since.
+    directory_mtime = dirlist_mtime(directory);
+    if (dirlist_cache_take(&directory_cache, directory, directory_mtime,
+        &directory_list, directory_list_position) == 0) return;
 
-    if(n < 0)
-    {
-        pthread_mutex_unlock(directory_mutex);
+    // Directories the library index has, unchanged, are listed without
+    // reading them.  Others are read in the background, and shown as they
+    // are read.
+    if (library_list(&directory_list, directory, 0, directory_mtime) == 0)
         return;
-    }
-
-    *directory_list_size = n;
+    if (dirlist_load(&directory_loader, directory, 0) == 0)
+        directory_loading = 1;
+    else if (dirlist_read(&directory_list, directory, 0) != 0)
+        directory_incomplete = 1;
+}
 
-    pthread_mutex_unlock(directory_mutex);
+// Add the entries read by directory_loader to the directory list, keeping
+// the cursor on the entry it was on.
+void take_directory_entries()
+{
+    int pos = *directory_list_position;
+    int had_entry = pos < directory_list.count;
+    // Entries keep their names' place in the arena when sorted.
+    unsigned int name = had_entry ? directory_list.entries[pos].name : 0;
+    int loading = dirlist_load_take(&directory_loader, &directory_list);
+    directory_loading = loading > 0;
+    if (loading < 0) directory_incomplete = 1;
+    int i = 0;
+    for (i = 0; had_entry && i < directory_list.count; i++)
+    {
+        if (directory_list.entries[i].name == name)
+        {
+            *directory_list_position = i;
+            break;
+        }
+    }
+    // The titles have moved.
+    list_gen++;
+    request_redraw();
 }
 
 void wd_change_directory(const char* directory)
 {
     // Construct the name of the directory to change to.
-    pthread_mutex_lock(directory_mutex);
     char *current_directory = strdup(*directory_path);
-    pthread_mutex_unlock(directory_mutex);
 
     char *new_directory = 0;
     if(strcmp(directory, ".") == 0) new_directory = strdup(current_directory);
@@ -378,8 +494,6 @@ void wd_change_directory(const char* directory)
 // 'start'.
 void wd_queue_directory(const char* start)
 {
-    pthread_mutex_lock(directory_mutex);
-    pthread_mutex_lock(playlist_mutex);
     // Free the current playlist.
     struct playlist_t *head = *playlist;
     *playlist = 0;
@@ -392,76 +506,39 @@ void wd_queue_directory(const char* start)
         head = next;
     }
 
-    struct dirent **dlist;
-    int n = scandir(*directory_path, &dlist, &is_mp3, &dirname_cmp);
+    // The directory list has the files unless it is still being read.
+    struct dirlist_t files;
+    const struct dirlist_t *list = &directory_list;
+    if (directory_loading)
+    {
+        list = &files;
+        if (library_list(&files, *directory_path, DIRLIST_AUDIO_ONLY,
+            dirlist_mtime(*directory_path)))
+            dirlist_read(&files, *directory_path, DIRLIST_AUDIO_ONLY);
+    }
     int i;
-    for (i = 0; i < n; i++)
+    for (i = 0; i < list->count; i++)
     {
-        if(start && strcmp(start, dlist[i]->d_name) > 0) continue;
-        char *path =
-            malloc(strlen(*directory_path) + strlen(dlist[i]->d_name) + 2);
-        sprintf(path, "%s/%s", *directory_path, dlist[i]->d_name);
-        append_to_playlist(path, dlist[i]->d_name);
+        const char *name = dirlist_name(list, i);
+        if(list->entries[i].type != DIRLIST_AUDIO) continue;
+        if(start && strcmp(start, name) > 0) continue;
+        char *path = malloc(strlen(*directory_path) + strlen(name) + 2);
+        sprintf(path, "%s/%s", *directory_path, name);
+        append_to_playlist(path, name);
         free(path);
-        free(dlist[i]);
     }
-    free(dlist);
-    pthread_mutex_unlock(playlist_mutex);
-    pthread_mutex_unlock(directory_mutex);
-}
-
-void draw_directory_list()
-{
-    pthread_mutex_lock(directory_mutex);
-    char s1[lcd_width() + 1], s2[lcd_width() + 1], s3[lcd_width() + 1];
-    // directory_list_position, directory_list_size
-    if( (*directory_list_position - 1) >= 0 && (*directory_list_position - 1)
-        < *directory_list_size )
-    {
-        // Draw s1
-        snprintf((char*)&s1, lcd_width() + 1, " %s", (*directory_list)[*directory_list_position - 1]->d_name);
-    } else s1[0] = 0;
-    if( *directory_list_position >= 0 && *directory_list_position <
-        *directory_list_size )
-    {
-        // Draw s2
-        pthread_mutex_lock(player_state_mutex);
-        char *title = scroll_text(
-            (*directory_list)[*directory_list_position]->d_name, lcd_width() - 1, *player_state_scroll_pos);
-        pthread_mutex_unlock(player_state_mutex);
-        snprintf((char*)&s2, lcd_width() + 1, "-%s", title);
-        if(title) free(title);
-    } else s2[0] = 0;
-    if( (*directory_list_position + 1) >= 0 && (*directory_list_position + 1)
-        < *directory_list_size )
-    {
-         // Draw s3
-        snprintf((char*)&s3, lcd_width() + 1, " %s", (*directory_list)[*directory_list_position + 1]->d_name);
-    } else s3[0] = 0;
-    pthread_mutex_unlock(directory_mutex);
-
-    char title_line[lcd_width() + 1];
-    char *t = position_string();
-    snprintf((char*)&title_line, 21, "Files%-*s%s",
-        lcd_width() - POSITION_STRING_LEN - 5, "", t);
-    free(t);
-    lcd_4line((char*)&title_line, (char*)&s1, (char*)&s2, (char*)&s3);
-    lcd_2line((char*)&s1, (char*)&s2);
+    if (list == &files) dirlist_free(&files);
 }
 
 void move_list(int rel)
 {
-    pthread_mutex_lock(directory_mutex);
     if(*directory_list_position + rel >= 0 &&
-        *directory_list_position + rel < *directory_list_size)
+        *directory_list_position + rel < directory_list.count)
     {
         *directory_list_position += rel;
     }
-    pthread_mutex_unlock(directory_mutex);
-    pthread_mutex_lock(player_state_mutex);
-    *player_state_scroll_pos = 0;
-    pthread_mutex_unlock(player_state_mutex);
-    pthread_mutex_unlock(redraw_sig);
+    player_set_scroll_pos(0);
+    request_redraw();
 }
 
 void move_list_up()
@@ -474,219 +551,92 @@ void move_list_down()
     move_list(1);
 }
 
-void *scroll_thread(void *v)
-{
-    while (1)
-    {
-        SDL_Delay(350);
-        pthread_mutex_lock(player_state_mutex);
-        (*player_state_scroll_pos)++;
-        pthread_mutex_unlock(player_state_mutex);
-        pthread_mutex_unlock(redraw_sig);
-    }
-}
-
-char *position_string()
+void button_event(const struct button_event_t *e)
 {
-    pthread_mutex_lock(player_state_mutex);
-    char *s = malloc(6);
-    if(*player_state == PLAYING || *player_state == PAUSED)
+    int b = LCD_BUTTON_NONE;
+    switch (e->type)
     {
-        snprintf((char*)s, 6, "%02d:%02d",
-            *player_state_position_seconds / 60,
-            *player_state_position_seconds % 60);
-    } else {
-        snprintf((char*)s, 6, "--:--");
-    }
-    pthread_mutex_unlock(player_state_mutex);
-    return s;
-}
-
-char *scroll_text(const char* text, int length, int scroll_pos)
-{
-    if(!text)
-        return strdup("");
-    char *title = 0;
-    int tlen = strlen(text);
-    // The number of scroll positions that should be shown for this string.
-    // The text is stationary for the first five and last five steps to make it
-    // easier to read.
-    int steps = tlen - length + 10;
-    if(
-            tlen > lcd_width() &&
-            // Only scroll after the first five steps.
-            (scroll_pos % steps) > 5
-            )
-    {
-        title = strdup(
-            text +
-            (
-                ((scroll_pos - 5) % steps > (tlen-length))?
-                    (tlen - length):
-                    ((scroll_pos - 5) % steps)
-            )
-            );
-    } else {
-        title = strdup(text);
-    }
-    return title;
-}
-
-void draw_now_playing()
-{
-    char *position = position_string();
-    char status_string[lcd_width() + 1];
-    pthread_mutex_lock(player_state_mutex);
-    int state = *player_state;
-    char *title = scroll_text(
-            *player_state_title,
-            lcd_width(),
-            *player_state_scroll_pos
-            );
-    pthread_mutex_unlock(player_state_mutex);
-    const char *play_status = 0;
-    switch(state)
-    {
-    case PAUSED:
-        play_status = "PAUSED";
+    case BUTTON_PRESS:
+    case BUTTON_REPEAT:
+        if (e->button != LCD_BUTTON_PLAY) b = e->button;
         break;
-    case PLAYING:
-        play_status = "PLAYING";
-        break;
-    case STOPPED:
-    default:
-        play_status = "NO FILE";
-        break;
-    }
-    snprintf(
-        (char*)&status_string,
-        lcd_width() + 1,
-        "%-*s%s",
-        lcd_width() - POSITION_STRING_LEN,
-        play_status,
-        position
-        );
-    switch (state)
-    {
-        case STOPPED:
-        lcd_4line(
-                "    Now Playing     ",
-                "                    ",
-                "      NO FILE       ",
-                "                    "
-                );
+    case BUTTON_RELEASE:
+        // PLAY acts when it is let go, unless it was held down to change
+        // mode or pressed together with another button.
+        if (e->button == LCD_BUTTON_PLAY && e->flags == 0) b = LCD_BUTTON_PLAY;
         break;
-        case PLAYING:
-        lcd_4line(
-                "    Now Playing     ",
-                position,
-                title,
-                "                    "
-                );
+    case BUTTON_LONG:
+        if (e->button == LCD_BUTTON_PLAY && !(e->flags & BUTTON_FLAG_CHORD))
+            b = MODE;
         break;
-        case PAUSED:
-        lcd_4line(
-                "    Now Playing     ",
-                position,
-                title,
-                "      PAUSED        "
-                );
+    case BUTTON_CHORD:
         break;
     }
-    lcd_2line((char*)&status_string, title);
-    free(position);
-    if(title) free(title);
-}
-
-void draw_vol()
-{
-    // Display volume as a 'progress bar'.
-    char bar[lcd_width() + 1];
-    snprintf(
-            (char*)&bar,
-            (size_t)(lcd_width() + 1),
-            "%-*s|%-*s+%-*s|",
-            (lcd_width() - 16)/2,
-            "",
-            volume,
-            "",
-            13 - volume,
-            ""
-            );
-
-    char title_line[lcd_width() + 1];
-    char *t = position_string();
-    snprintf(
-            (char*)&title_line,
-            lcd_width() + 1,
-            "Volume%-*s%s",
-            lcd_width() - POSITION_STRING_LEN - 6,
-            "",
-            t
-            );
-    free(t);
-    lcd_4line((char*)&title_line, "", (char*)&bar, "");
-    lcd_2line((char*)&title_line, (char*)&bar);
+    if (b == LCD_BUTTON_NONE) return;
+    input_queue_push(&input_queue, b, e->time_ns);
 }
 
 void *button_press_thread(void* v)
 {
-    // Poll GPIO pins.
+    // Read the buttons, or simulated button presses from stdin.
 #ifdef SIMULATE_BUTTONS
     char *buffer = 0;
     size_t s = 0;
     while (getline(&buffer, &s, stdin) >= 0)
     {
-        pthread_mutex_lock(button_press_mutex);
-        if(strncmp(buffer, "up", 2) == 0)
-        {
-            *button_press = LCD_BUTTON_VOLUP;
-            pthread_mutex_unlock(button_press_sig);
-        }
-        if(strncmp(buffer, "down", 4) == 0)
-        {
-            *button_press = LCD_BUTTON_VOLDOWN;
-            pthread_mutex_unlock(button_press_sig);
-        }
-        if(strncmp(buffer, "play", 4) == 0)
-        {
-            *button_press = LCD_BUTTON_PLAY;
-            pthread_mutex_unlock(button_press_sig);
-        }
-        if(strncmp(buffer, "mode", 4) == 0)
-        {
-            *button_press = MODE;
-            pthread_mutex_unlock(button_press_sig);
-        }
-        if(strncmp(buffer, "quit", 4) == 0)
-        {
-            *button_press = QUIT;
-            pthread_mutex_unlock(button_press_sig);
-        }
-        pthread_mutex_unlock(button_press_mutex);
+        int b = LCD_BUTTON_NONE;
+        if(strncmp(buffer, "up", 2) == 0) b = LCD_BUTTON_VOLUP;
+        if(strncmp(buffer, "down", 4) == 0) b = LCD_BUTTON_VOLDOWN;
+        if(strncmp(buffer, "play", 4) == 0) b = LCD_BUTTON_PLAY;
+        if(strncmp(buffer, "mode", 4) == 0) b = MODE;
+        if(strncmp(buffer, "quit", 4) == 0) b = QUIT;
+        if(b != LCD_BUTTON_NONE)
+            input_queue_push(&input_queue, b, button_time_ns());
     }
 #else // #ifdef SIMULATE_BUTTONS
-    while (1)
+    struct button_debounce_t debounce;
+    struct button_event_t events[16];
+    int i = 0;
+    button_debounce_init(&debounce,
+        (1u << LCD_BUTTON_VOLUP) | (1u << LCD_BUTTON_VOLDOWN));
+    if (button_chip && button_open_chip(button_chip) == 0)
     {
-        DELAY_MILLIS(50);
-        int b = poll_button_press();
-        if(b == LCD_BUTTON_NONE) continue;
-        pthread_mutex_lock(button_press_mutex);
-        *button_press = b;
-        if (*button_press == LCD_BUTTON_VOLUP || *button_press == LCD_BUTTON_VOLDOWN)
+        // Sleep until an edge or until the debouncer has something to send.
+        // The first wait returns at once with the levels of the lines.
+        int timeout_ms = 0;
+        while (1)
         {
-            pthread_mutex_unlock(button_press_mutex);
-            pthread_mutex_unlock(button_press_sig);
-            DELAY_MILLIS(300); // Delay for multiple button presses
-            continue;
-        } else {
-            pthread_mutex_unlock(button_press_sig);
-            pthread_mutex_unlock(button_press_mutex);
-
-            // Wait for the button to be released
-            while (poll_button_press() != LCD_BUTTON_NONE)
-                DELAY_MILLIS(50);
+            unsigned int raw = 0;
+            unsigned long long t = 0;
+            int r = button_wait(timeout_ms, &raw, &t);
+            if (r < 0) break;
+            if (r == 0) t = button_time_ns();
+            int n = button_debounce_update(&debounce, raw, t, events, 16);
+            for (i = 0; i < n; i++) button_event(&events[i]);
+
+            unsigned long long deadline = button_debounce_deadline(&debounce);
+            unsigned long long now = button_time_ns();
+            timeout_ms = -1;
+            if (deadline)
+            {
+                timeout_ms = (deadline > now) ?
+                    (deadline - now + 999999) / 1000000 : 0;
+            }
         }
+        button_close_chip();
+        fprintf(stderr, "Falling back to polling the buttons\n");
+        button_debounce_init(&debounce,
+            (1u << LCD_BUTTON_VOLUP) | (1u << LCD_BUTTON_VOLDOWN));
+    }
+    while (1)
+    {
+        int n = button_debounce_update(&debounce, poll_buttons(),
+            button_time_ns(), events, 16);
+        for (i = 0; i < n; i++) button_event(&events[i]);
+        if (button_debounce_deadline(&debounce))
+            DELAY_MILLIS(BUTTON_POLL_MILLIS);
+        else
+            DELAY_MILLIS(BUTTON_IDLE_POLL_MILLIS);
     }
 #endif// #ifdef SIMULATE_LCD
 }
@@ -696,64 +646,35 @@ void play_init()
     // Initialise global variables.
     directory_path = malloc(sizeof(char*));
     *directory_path = 0;
-    directory_list = malloc(sizeof(struct dirent*));
-    *directory_list = 0;
-    directory_list_size = malloc(sizeof(int));
-    *directory_list_size = -1;
     directory_list_position = malloc(sizeof(int));
     *directory_list_position = 0;
-
-    directory_mutex = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(directory_mutex, 0);
+    if (dirlist_loader_init(&directory_loader) != 0) exit(1);
 
     Mix_Music *mus = 0;
 
     // Initialise playlist variables.
-    playlist_mutex = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(playlist_mutex, 0);
-    next_track_mutex = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(next_track_mutex, 0);
-    pthread_mutex_trylock(next_track_mutex);
-
     playlist = malloc(sizeof(struct playlist_t*));
     *playlist = 0;
 
-    // Initialise button press variables.
-    button_press = malloc(sizeof(int));
-    button_press_mutex = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(button_press_mutex, 0);
-    button_press_sig = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(button_press_sig, 0);
-
-    // Initialise player_state.
-    player_state = malloc(sizeof(enum player_state_t));
-    *player_state = STOPPED;
-    player_state_title = malloc(sizeof(char*));
-    *player_state_title = 0;
-    player_state_position = malloc(sizeof(int));
-    *player_state_position = 0;
-    player_state_position_seconds = malloc(sizeof(int));
-    *player_state_position_seconds = 0;
-    player_state_scroll_pos = malloc(sizeof(int));
-    *player_state_scroll_pos = 0;
-    player_state_mode = malloc(sizeof(enum mode_t));
-    *player_state_mode = FILES;
-    player_state_mutex = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(player_state_mutex, 0);
-
-    // Initialise screen redraw signal.
-    redraw_sig = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(redraw_sig, 0);
-    pthread_mutex_trylock(redraw_sig);
+    // Initialise the button press queue.
+    if (input_queue_init(&input_queue) != 0) exit(1);
 
-    // Start button press thread.
-    pthread_create(&button_press_pthread, 0, &button_press_thread, 0);
+    // Initialise the player state.  SDL's audio thread has not started, so
+    // no lock is needed.
+    memset(&player, 0, sizeof(player));
+    player.state = STOPPED;
+    player.mode = FILES;
 
-    // Start screen redraw thread.
-    pthread_create(&redraw_pthread, 0, &redraw_thread, 0);
+    // Initialise the notifications from SDL's threads and the timers.
+    audio_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (audio_fd < 0 || timer_wheel_init(&timers) != 0)
+    {
+        fprintf(stderr, "Could not create event descriptors\n");
+        exit(1);
+    }
 
-    // Start scrolling thread.
-    pthread_create(&scroll_pthread, 0, &scroll_thread, 0);
+    // Start button press thread.
+    pthread_create(&button_press_pthread, 0, &button_press_thread, 0);
 
     if(SDL_Init(SDL_INIT_AUDIO) < 0)
     {
@@ -775,26 +696,26 @@ void play_init()
         exit(1);
     }
 
+    screen_init(&screen);
+
     volume = 7;
     Mix_VolumeMusic(volume_level[volume]);
 
     // Queue the next track when a track finishes.
-    Mix_HookMusicFinished(&continue_queue);
-
-    pthread_create(&next_track_pthread, 0, &next_track_thread, 0);
+    Mix_HookMusicFinished(&music_finished);
 }
 
 void change_mode(enum mode_t mode)
 {
-    pthread_mutex_lock(player_state_mutex);
-    *player_state_mode = mode;
-    pthread_mutex_unlock(player_state_mutex);
-    pthread_mutex_unlock(redraw_sig);
+    player_write_begin();
+    __atomic_store_n(&player.mode, mode, __ATOMIC_RELAXED);
+    player_write_end();
+    request_redraw();
 }
 
 void button_press_files(enum button_press_t button)
 {
-    switch (*button_press)
+    switch (button)
     {
         case QUIT: break;
         case LCD_BUTTON_VOLUP:
@@ -808,15 +729,13 @@ void button_press_files(enum button_press_t button)
         // the directory.  If it is an audio file, replace the
         // playlist with the audio files in the current list
         // starting at directory_list_position.
-        if (*directory_list && *directory_list_position >= 0)
+        if (*directory_list_position >= 0 &&
+            *directory_list_position < directory_list.count)
         {
-            pthread_mutex_lock(directory_mutex);
-            struct stat buf;
-            wdstat((*directory_list)[*directory_list_position]->d_name, &buf);
-            char *new_directory = strdup((*directory_list)
-                [*directory_list_position]->d_name);
-            pthread_mutex_unlock(directory_mutex);
-            if (S_ISDIR(buf.st_mode))
+            int pos = *directory_list_position;
+            char *new_directory =
+                strdup(dirlist_name(&directory_list, pos));
+            if (directory_list.entries[pos].type == DIRLIST_DIR)
             {
                 // If the directory is "." (current directory),
                 // queue all songs in the directory instead.
@@ -825,25 +744,22 @@ void button_press_files(enum button_press_t button)
                     // Queue all songs in this directory.
                     wd_queue_directory(0);
                     // New songs queued; play the next track.
-                    continue_queue();
+                    queue_next();
                     change_mode(NOW);
                 } else {
                     // Enter the directory.
                     wd_change_directory(new_directory);
                 }
-            } else if (S_ISREG(buf.st_mode))
-            {
+            } else {
                 Mix_HaltMusic();
-                pthread_mutex_lock(player_state_mutex);
-                *player_state = STOPPED;
-                pthread_mutex_unlock(player_state_mutex);
+                player_set_state(STOPPED);
                 // Queue the directory starting at 'start'.
                 wd_queue_directory(new_directory);
                 // New songs queued; play the next track.
-                continue_queue();
+                queue_next();
                 change_mode(NOW);
             }
-            pthread_mutex_unlock(redraw_sig);
+            request_redraw();
             free(new_directory);
         }
     }
@@ -851,21 +767,19 @@ void button_press_files(enum button_press_t button)
 
 void button_press_now(enum button_press_t button)
 {
-    switch (*button_press)
+    switch (button)
     {
         case QUIT: break;
         case UP:
         // Skip forward ten seconds.
-        pthread_mutex_lock(player_state_mutex);
         int setpos = 10 * PLAY_SAMPLERATE * 4;
         // If this is an OGG track, Mix_SetMusicPosition takes an
         // absolute position, not relative.
         if(Mix_GetMusicType(mus) == MUS_OGG)
-            setpos += *player_state_position_seconds;
+            setpos += player_position_seconds();
         int track_ended = 0;
         // Current time, use to set position
-        int seconds = *player_state_position_seconds;
-        pthread_mutex_unlock(player_state_mutex);
+        int seconds = player_position_seconds();
 
         /*if(Mix_GetMusicType(mus) == MUS_OGG) seconds += 10;
         if(Mix_GetMusicType(mus) == MUS_MP3) seconds = 10;*/
@@ -873,91 +787,73 @@ void button_press_now(enum button_press_t button)
 
         if(Mix_SetMusicPosition(seconds) == 0)
         {
-            pthread_mutex_lock(player_state_mutex);
-            *player_state_position += 10 * PLAY_SAMPLERATE * 4;
-            *player_state_position_seconds += 10;
-            pthread_mutex_unlock(player_state_mutex);
+            player_move_position(10 * PLAY_SAMPLERATE * 4);
         } else {
-            pthread_mutex_lock(player_state_mutex);
-            *player_state_position = 0;
-            *player_state_position_seconds = 0;
+            player_set_position(0);
             Mix_HaltMusic();
             track_ended = 1;
-            pthread_mutex_unlock(player_state_mutex);
         }
-        if(track_ended) continue_queue();
-        pthread_mutex_unlock(redraw_sig);
+        if(track_ended) queue_next();
+        request_redraw();
         break;
         case DOWN: {
         // Skip back ten seconds (or to the start of the track).
         // Simpler than skipping forward because we know that
         // current - 10s is inside the track.
-        pthread_mutex_lock(player_state_mutex);
-        int seconds = *player_state_position_seconds;
-        pthread_mutex_unlock(player_state_mutex);
+        int seconds = player_position_seconds();
         Mix_RewindMusic();
         if(seconds >= 10 &&
             Mix_SetMusicPosition(
                 seconds - 10) == 0)
         {
-            pthread_mutex_lock(player_state_mutex);
-            *player_state_position -= 10 * PLAY_SAMPLERATE * 4;
-            *player_state_position_seconds -= 10;
-            pthread_mutex_unlock(player_state_mutex);
+            player_move_position(-10 * PLAY_SAMPLERATE * 4);
         } else {
-            pthread_mutex_lock(player_state_mutex);
-            *player_state_position = 0;
-            *player_state_position_seconds = 0;
-            pthread_mutex_unlock(player_state_mutex);
+            player_set_position(0);
         }
         break; }
         case PLAY:
-        pthread_mutex_lock(player_state_mutex);
-        switch (*player_state)
+        switch (player.state)
         {
             case PAUSED:
             // There is music loaded into SDL_mixer, start playing.
             fprintf(stderr, "Resume\n");
             Mix_ResumeMusic();
-            *player_state = PLAYING;
+            player_set_state(PLAYING);
             break;
             case PLAYING:
             // Pause the music currently playing.
             fprintf(stderr, "Pause\n");
             Mix_PauseMusic();
-            *player_state = PAUSED;
+            player_set_state(PAUSED);
             break;
         }
-        pthread_mutex_unlock(player_state_mutex);
-        pthread_mutex_unlock(redraw_sig);
+        request_redraw();
         break;
     }
 }
 
 void button_press_vol(enum button_press_t button)
 {
-    switch (*button_press)
+    switch (button)
     {
         case QUIT: break;
         case LCD_BUTTON_PLAY:
-        pthread_mutex_lock(player_state_mutex);
-        switch (*player_state)
+        switch (player.state)
         {
            case PAUSED:
             // There is music loaded into SDL_mixer, start playing.
             fprintf(stderr, "Resume\n");
             Mix_ResumeMusic();
-            *player_state = PLAYING;
+            player_set_state(PLAYING);
             break;
             case PLAYING:
             // Pause the music currently playing.
             fprintf(stderr, "Pause\n");
             Mix_PauseMusic();
-            *player_state = PAUSED;
+            player_set_state(PAUSED);
             break;
         }
-        pthread_mutex_unlock(player_state_mutex);
-        pthread_mutex_unlock(redraw_sig);
+        request_redraw();
         break;
         case LCD_BUTTON_VOLUP:
         change_mode(VOL);
@@ -967,7 +863,7 @@ void button_press_vol(enum button_press_t button)
             Mix_VolumeMusic(volume_level[volume]);
             fprintf(stderr, "New volume: %d\n", volume);
         }
-        pthread_mutex_unlock(redraw_sig);
+        request_redraw();
         break;
         case LCD_BUTTON_VOLDOWN:
         change_mode(VOL);
@@ -977,15 +873,134 @@ void button_press_vol(enum button_press_t button)
             Mix_VolumeMusic(volume_level[volume]);
             fprintf(stderr, "New volume: %d\n", volume);
         }
-        pthread_mutex_unlock(redraw_sig);
+        request_redraw();
+        break;
+    }
+}
+
+void handle_button_press(enum button_press_t button)
+{
+    enum mode_t mode = player.mode;
+    // Context-free buttons (RW, FF, FILE, VOL) are processed in the
+    // same way for all modes.
+    switch (button)
+    {
+    case LCD_BUTTON_FF:
+        // Skip forward ten seconds.
+        int setpos = 10 * PLAY_SAMPLERATE * 4;
+        // If this is an OGG track, Mix_SetMusicPosition takes an
+        // absolute position, not relative.
+        if (Mix_GetMusicType(mus) == MUS_OGG)
+            setpos += player_position_seconds();
+        int track_ended = 0;
+        // Current time, use to set position
+        int seconds = player_position_seconds();
+
+        /*if (Mix_GetMusicType(mus) == MUS_OGG) seconds += 10;
+        if (Mix_GetMusicType(mus) == MUS_MP3) seconds = 10;*/
+        seconds += 10;
+
+        if (Mix_SetMusicPosition(seconds) == 0)
+        {
+            player_move_position(10 * PLAY_SAMPLERATE * 4);
+        } else {
+            player_set_position(0);
+            Mix_HaltMusic();
+            track_ended = 1;
+        }
+        if (track_ended) queue_next();
+        request_redraw();
+        break;
+    case LCD_BUTTON_RW: {
+        // Skip back ten seconds (or to the start of the track).
+        // Simpler than skipping forward because we know that
+        // current - 10s is inside the track.
+        int seconds = player_position_seconds();
+        Mix_RewindMusic();
+        if (seconds >= 10 &&
+            Mix_SetMusicPosition(
+                seconds - 10) == 0)
+        {
+            player_move_position(-10 * PLAY_SAMPLERATE * 4);
+        } else {
+            player_set_position(0);
+        }
+        break; }
+    case LCD_BUTTON_FILE:
+        change_mode(FILES);
+        break;
+    case LCD_BUTTON_VOL:
+        change_mode(VOL);
+        break;
+    case LCD_BUTTON_NOW:
+        change_mode(NOW);
+        break;
+    case MODE:
+        // Holding PLAY steps through the modes.
+        change_mode(mode == FILES ? NOW : (mode == NOW ? VOL : FILES));
+        break;
+    }
+
+    switch (mode)
+    {
+    case FILES:
+        button_press_files(button);
+        break;
+    case NOW:
+        button_press_now(button);
+        break;
+    case VOL:
+        button_press_vol(button);
         break;
     }
 }
 
 int main(int argc, char* argv[])
 {
+    // The type of LCD and how it is connected can be chosen on the command
+    // line so that one build works with any supported screen.
+    enum lcd_screen_type_t lcd_type = LCD_BUTTON_PLAY_LCD_TYPE;
+    const char *library_file = LIBRARY_DEFAULT_FILE;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "b:g:i:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            if (lcd_set_backend(optarg) != 0)
+            {
+                fprintf(stderr, "Unknown LCD backend: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            button_chip = optarg;
+            break;
+        case 'i':
+            library_file = optarg;
+            break;
+        case 'l':
+            if (lcd_screen_type_from_name(optarg, &lcd_type) != 0)
+            {
+                fprintf(stderr, "Unknown LCD type: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b lcd backend] [-g gpio chip] [-i library index] [-l lcd type] [directory]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // SIGUSR1 is read from a signalfd by the main loop, so block it before
+    // any threads are started; they inherit the mask.
+    sigset_t sigusr1;
+    sigemptyset(&sigusr1);
+    sigaddset(&sigusr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigusr1, 0);
+
     // Initialise the LCD.
-    if (lcd_init(LCD_BUTTON_PLAY_LCD_TYPE) != 0)
+    if (lcd_init(lcd_type) != 0)
     {
         fprintf(stderr, "Error initialising LCD\n");
         return 1;
@@ -994,129 +1009,107 @@ int main(int argc, char* argv[])
     play_init();
 
     // Change the process' current working directory.
-    if(argc > 1)
+    if(argc > optind)
     {
-        chdir(argv[1]);
+        chdir(argv[optind]);
     }
+    // Load the index of the files under the directory, and bring it up to
+    // date in the background.
+    library_open(library_file, ".");
 
     change_directory(".");
-    pthread_mutex_unlock(redraw_sig);
-
-    // Start playing from the queue.
-    pthread_mutex_unlock(next_track_mutex);
+    request_redraw();
 
     // Print the queue.
-    pthread_mutex_lock(playlist_mutex);
     struct playlist_t *head = *playlist;
     while (head)
     {
-        fprintf(stderr, "Track: %s, %s\n", head->title, head->path);
+        fprintf(stderr, "Track: %s, %s\n", head->title->text, head->path);
         head = head->next;
     }
-    pthread_mutex_unlock(playlist_mutex);
+
+    // Everything the player reacts to is a file descriptor: button presses
+    // (the input queue's eventfd), SDL's audio thread, the timers for the
+    // scroll animation and the clock, SIGUSR1, which prints statistics, and
+    // the thread reading the directory.
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int signal_fd = signalfd(-1, &sigusr1, SFD_CLOEXEC | SFD_NONBLOCK);
+    const int fds[] = { input_queue.fd, audio_fd, timers.fd, signal_fd,
+        directory_loader.fd };
+    int i = 0;
+    for (i = 0; i < 5; i++)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev) != 0)
+        {
+            fprintf(stderr, "Could not wait for events\n");
+            return 1;
+        }
+    }
 
     int quit = 0;
     while (!quit)
     {
-        // Pretend to poll the bcm2835 pins.
-        int l = pthread_mutex_trylock(button_press_sig);
-        if(l == 0)
+        // Draw the screen once for all the events handled since the last
+        // wait, then sleep until something happens.
+        if (redraw_pending)
+        {
+            redraw_pending = 0;
+            redraw();
+        }
+        struct epoll_event events[5];
+        int n = epoll_wait(epoll_fd, events, 5, -1);
+        if (n > 0) loop_wakeups++;
+        for (i = 0; i < n; i++)
         {
-            // A new button press is available.
-            pthread_mutex_lock(button_press_mutex);
-            // Apply the button press.
-            if(*button_press == QUIT) quit = 1;
-
-            pthread_mutex_lock(player_state_mutex);
-            enum mode_t mode = *player_state_mode;
-            pthread_mutex_unlock(player_state_mutex);
-            // Context-free buttons (RW, FF, FILE, VOL) are processed in the
-            // same way for all modes.
-            switch (*button_press)
+            int fd = events[i].data.fd;
+            uint64_t v;
+            if (fd == input_queue.fd)
             {
-            case LCD_BUTTON_FF:
-                // Skip forward ten seconds.
-                pthread_mutex_lock(player_state_mutex);
-                int setpos = 10 * PLAY_SAMPLERATE * 4;
-                // If this is an OGG track, Mix_SetMusicPosition takes an
-                // absolute position, not relative.
-                if (Mix_GetMusicType(mus) == MUS_OGG)
-                    setpos += *player_state_position_seconds;
-                int track_ended = 0;
-                // Current time, use to set position
-                int seconds = *player_state_position_seconds;
-                pthread_mutex_unlock(player_state_mutex);
-
-                /*if (Mix_GetMusicType(mus) == MUS_OGG) seconds += 10;
-                if (Mix_GetMusicType(mus) == MUS_MP3) seconds = 10;*/
-                seconds += 10;
-
-                if (Mix_SetMusicPosition(seconds) == 0)
+                input_queue_wait(&input_queue);
+                struct input_event_t e;
+                while (!quit && input_queue_pop(&input_queue, &e))
                 {
-                    pthread_mutex_lock(player_state_mutex);
-                    *player_state_position += 10 * PLAY_SAMPLERATE * 4;
-                    *player_state_position_seconds += 10;
-                    pthread_mutex_unlock(player_state_mutex);
-                } else {
-                    pthread_mutex_lock(player_state_mutex);
-                    *player_state_position = 0;
-                    *player_state_position_seconds = 0;
-                    Mix_HaltMusic();
-                    track_ended = 1;
-                    pthread_mutex_unlock(player_state_mutex);
+                    if (e.button == QUIT) quit = 1;
+                    else handle_button_press(e.button);
                 }
-                if (track_ended) continue_queue();
-                pthread_mutex_unlock(redraw_sig);
-                break;
-            case LCD_BUTTON_RW: {
-                // Skip back ten seconds (or to the start of the track).
-                // Simpler than skipping forward because we know that
-                // current - 10s is inside the track.
-                pthread_mutex_lock(player_state_mutex);
-                int seconds = *player_state_position_seconds;
-                pthread_mutex_unlock(player_state_mutex);
-                Mix_RewindMusic();
-                if (seconds >= 10 &&
-                    Mix_SetMusicPosition(
-                        seconds - 10) == 0)
+            } else if (fd == audio_fd)
+            {
+                ssize_t r = read(audio_fd, &v, sizeof(v));
+                (void)r;
+                unsigned int audio =
+                    __atomic_exchange_n(&audio_events, 0, __ATOMIC_ACQUIRE);
+                if (audio & AUDIO_FINISHED) queue_next();
+                // AUDIO_SEEKED only needs the redraw, which also sets the
+                // clock timer from the new position.
+                request_redraw();
+            } else if (fd == timers.fd)
+            {
+                unsigned int expired = timer_wheel_expire(&timers);
+                // The animation wraps around once the whole field has been
+                // shown.
+                if ((expired & (1u << TIMER_SCROLL)) && screen.scroll_steps)
                 {
-                    pthread_mutex_lock(player_state_mutex);
-                    *player_state_position -= 10 * PLAY_SAMPLERATE * 4;
-                    *player_state_position_seconds -= 10;
-                    pthread_mutex_unlock(player_state_mutex);
-                } else {
-                    pthread_mutex_lock(player_state_mutex);
-                    *player_state_position = 0;
-                    *player_state_position_seconds = 0;
-                    pthread_mutex_unlock(player_state_mutex);
+                    player_set_scroll_pos(
+                        (player.scroll_pos + 1) % screen.scroll_steps);
                 }
-                break; }
-            case LCD_BUTTON_FILE:
-                change_mode(FILES);
-                break;
-            case LCD_BUTTON_VOL:
-                change_mode(VOL);
-                break;
-            case LCD_BUTTON_NOW:
-                change_mode(NOW);
-                break;
-            }
-
-            switch (mode)
+                request_redraw();
+            } else if (fd == signal_fd)
+            {
+                struct signalfd_siginfo info;
+                ssize_t r = read(signal_fd, &info, sizeof(info));
+                (void)r;
+                lcd_print_stats();
+                input_queue_print_stats(&input_queue);
+                fprintf(stderr, "Main loop: %lu wakeups, %lu redraws\n",
+                    loop_wakeups, redraws);
+            } else if (fd == directory_loader.fd)
             {
-            case FILES:
-                button_press_files(*button_press);
-                break;
-            case NOW:
-                button_press_now(*button_press);
-                break;
-            case VOL:
-                button_press_vol(*button_press);
-                break;
+                take_directory_entries();
             }
-            pthread_mutex_unlock(button_press_mutex);
         }
-        SDL_Delay(50);
     }
 
     // Shut down SDL_mixer and SDL.
@@ -1125,6 +1118,8 @@ int main(int argc, char* argv[])
     Mix_CloseAudio();
     Mix_Quit();
     SDL_Quit();
+    dirlist_load_cancel(&directory_loader);
+    library_close();
     lcd_close();
 }
 
@@ -5,7 +5,8 @@
  * Copyright (C) 2014 James Goode.
  */
 
-#include <dirent.h>
+#include "button.h"
+#include "title.h"
 
 #define PLAY_SAMPLERATE 22050
 
@@ -41,12 +42,100 @@ enum player_state_t
     PLAYING
 };
 
+/*!
+ * State of the player shown on the screen.  SDL's audio thread is the only
+ * writer of the position, and it never waits for the main loop: it makes
+ * position_seq odd while it moves the position on and applies any seek the
+ * main loop has asked for.  The main loop changes the rest between
+ * player_write_begin and player_write_end, which make seq odd while it
+ * works.  Readers copy the state with player_snapshot, or read the position
+ * with player_position, trying again if a count was odd or changed.  Only
+ * the main loop writes the fields other than the position, so it may read
+ * them directly.
+ */
+struct player_t
+{
+    unsigned int seq;
+    unsigned int position_seq;
+    /*! Bytes of audio played, and the same in seconds. */
+    int position;
+    int position_seconds;
+    /*! Seek waiting for the audio thread: a number of bytes to move the
+     * position by, or the position to set if PLAYER_SEEK_TO is set.  Added
+     * to by the main loop, and taken by the audio thread. */
+    int seek;
+    enum player_state_t state;
+    enum mode_t mode;
+    /*! Step of the scroll animation for long titles. */
+    int scroll_pos;
+    /*! Title of the current track, or null. */
+    struct title_t *title;
+    /*! Incremented when title is replaced. */
+    unsigned int title_gen;
+} __attribute__((aligned(64)));
+
+/*!
+ * Start changing the player state, waiting for any other writer to finish.
+ */
+void player_write_begin();
+
+/*!
+ * Finish changing the player state.
+ */
+void player_write_end();
+
+/*!
+ * Copy a consistent snapshot of the player state without blocking writers.
+ * The position is read as player_position does.
+ */
+void player_snapshot(struct player_t *s);
+
+/*!
+ * \return The position in the track in bytes, including any seek the audio
+ * thread has not applied yet.
+ */
+int player_position();
+
+/*!
+ * \return player_position in whole seconds.
+ */
+int player_position_seconds();
+
+/*!
+ * Bit of player_t.seek set when it holds a position rather than a move.
+ * Positions are whole frames of four bytes, leaving the low bits free.
+ */
+#define PLAYER_SEEK_TO 1
+
+/*!
+ * Set the position in the track in bytes.  The audio thread applies the
+ * change, and sets AUDIO_SEEKED once it has.
+ */
+void player_set_position(int position);
+
+/*!
+ * Move the position in the track forwards (or backwards, if negative) by a
+ * number of bytes, as player_set_position.
+ */
+void player_move_position(int bytes);
+
+/*!
+ * Change the player state (stopped, paused, playing).
+ */
+void player_set_state(enum player_state_t state);
+
+/*!
+ * Set the step of the scroll animation.
+ */
+void player_set_scroll_pos(int scroll_pos);
+
 /*!
  * A linked list representing the playlist.
  */
 struct playlist_t
 {
-    char *path, *title;
+    char *path;
+    struct title_t *title;
     struct playlist_t *next;
 };
 
@@ -62,46 +151,57 @@ void play_music(const char* path);
 void queue_next();
 
 /*!
- * Wait for tracks to be added to the global playlist and start playing them.
- * To be called as a thread.
+ * Bits of audio_events: the track has finished, and the audio thread has
+ * applied a seek.
  */
-void *next_track_thread(void *v);
+#define AUDIO_FINISHED 1
+#define AUDIO_SEEKED 2
 
 /*!
- * Append a track to the global playlist.  This function is not thread safe,
- * so playlist_mutex must be locked when this function is called.  This is to
- * allow callers to append multiple items at once.
+ * Slots in the main loop's timer wheel.
  */
-void append_to_playlist(const char* path, const char *title);
+#define TIMER_SCROLL 0
+#define TIMER_CLOCK 1
 
 /*!
- * Perform the stat system call for a file in the current working directory.
- * This function is not thread safe, it requires that the directory list mutex
- * is locked.
+ * Tell the main loop about something that happened in one of SDL's threads.
+ * \param events AUDIO_* bits.
  */
-int wdstat(const char*, struct stat*);
+void notify_audio(unsigned int events);
 
 /*!
- * Clear and free all space used by the global list of files in the current
- * working directory.
+ * Called by SDL_mixer when a track finishes.
  */
-void free_directory_list();
+void music_finished();
+
+/*!
+ * Have the main loop draw the screen before it next waits for an event.
+ */
+void request_redraw();
+
+/*!
+ * Draw the screen for the current mode.
+ */
+void redraw();
 
 /*!
- * Check if the given dirent represents an MP3 file.
+ * Arm the scroll timer if the screen just drawn has a field too long for it,
+ * and the clock timer if it shows the position of a track that is playing;
+ * disarm them otherwise.
  */
-int is_mp3(const struct dirent*);
+void update_timers();
 
 /*!
- * Check if the given dirent represents either an MP3 or directory.
+ * Append a track to the global playlist, preparing its title for the LCD.
+ * Only called from the main loop.
  */
-int is_mp3_or_dir(const struct dirent*);
+void append_to_playlist(const char* path, const char *title);
 
 /*!
- * Comparision for ordering files in directory lists (alphabetical,
- * directories first).
+ * Clear and free all space used by the global list of files in the current
+ * working directory.
  */
-int dirname_cmp(const struct dirent**, const struct dirent**);
+void free_directory_list();
 
 /*!
  * Change the current working directory and store a list of new directory
@@ -122,14 +222,6 @@ void wd_change_directory(const char*);
  */
 void wd_queue_directory(const char*);
 
-// Draw the directory list on the LCD.
-void draw_directory_list();
-
-/*!
- * Draw the directory list on the LCD.
- */
-void draw_directory_list();
-
 /*!
  * Move the cursor position in the directory list (positive numbers move down
  * the list, negative numbers move up.
@@ -144,32 +236,6 @@ void move_list_up();
  */
 void move_list_down();
 
-/*!
- * Generate a string representing the current position (in minutes and
- * seconds).  The returned pointer must be freed with free().
- */
-char *position_string();
-
-/*!
- * Draw the 'now playing' screen.
- */
-void draw_now_playing();
-
-/*!
- * Generate a step in the scrolling text animation.
- *
- * \param length Length of the displayed string.
- * \param scroll_pos Stage in the scroll animation to show.
- * \note The returned string must be freed by the caller.
- * \note The returned string may be longer than the length parameter.
- */
-char *scroll_text(const char *text, int length, int scroll_pos);
-
-/*!
- * Draw the volume change screen.
- */
-void draw_vol();
-
 /*!
  * Initialise the music player, including SDL functions and the LCD screen.
  */
@@ -191,10 +257,20 @@ void button_press_now(enum button_press_t button);
  */
 void button_press_vol(enum button_press_t button);
 
+/*!
+ * Pass a debounced button event to the main loop as a button press.  PLAY
+ * acts on release, and holding it down gives MODE instead.
+ */
+void button_event(const struct button_event_t *e);
+
+/*!
+ * Apply a button press in the current mode.  Called from the main loop.
+ */
+void handle_button_press(enum button_press_t button);
+
 /*!
  * Thread that listens for button presses (or simulated button presses) and
- * signals button_press_mutex when one occurs.  The button press is stored in
- * the global button_press variable.
+ * adds them to the global input queue for the main loop.
  */
 void *button_press_thread(void*);
 
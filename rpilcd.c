@@ -15,234 +15,941 @@ D4 (11)             P1 16                   GPIO 22
 D5 (12)             P1 18                   GPIO 23
 D6 (13)             P1 19                   GPIO 24
 D7 (14)             P1 21                   GPIO 25
+D0 (7)              P1 29 (gpio8 only)      GPIO  5
+D1 (8)              P1 31 (gpio8 only)      GPIO  6
+D2 (9)              P1 32 (gpio8 only)      GPIO 12
+D3 (10)             P1 33 (gpio8 only)      GPIO 13
 RS (4)              P1 14                   GPIO 10
 E (6)               P1 15                   GPIO  4
+RW (5)              Ground, or any free GPIO with LCD_RW_GPIO=n (optional)
 
 */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifndef SIMULATE_LCD
 #include <bcm2835.h>
 #endif
 #include "rpilcd.h"
+#include "lcd_backend.h"
+#include "hd44780_sim.h"
 
 // These are GPIO pin numbers, not Raspberry Pi pin numbers.
 #define LCDPIN_D4   22
 #define LCDPIN_D5   23
 #define LCDPIN_D6   24
 #define LCDPIN_D7   25
+// D0-D3 are only used by the 8-bit (gpio8) backend.
+#define LCDPIN_D0   5
+#define LCDPIN_D1   6
+#define LCDPIN_D2   12
+#define LCDPIN_D3   13
 #define LCDPIN_RS   10
 #define LCDPIN_E    4
+// RW is normally wired to ground.  If it is connected to a GPIO pin instead
+// (build with LCD_RW_GPIO=n), the busy flag is read rather than waiting for
+// the worst case execution time of each instruction.
+//#define LCDPIN_RW 27
 
 // LCD data pins (four pins, transfers one nibble at a time).
 const int lcdpin[] = { LCDPIN_D4, LCDPIN_D5, LCDPIN_D6, LCDPIN_D7 };
 
+// LCD data pins in 8-bit mode (eight pins, transfers a byte at a time).
+const int lcdpin8[] = {
+    LCDPIN_D0, LCDPIN_D1, LCDPIN_D2, LCDPIN_D3,
+    LCDPIN_D4, LCDPIN_D5, LCDPIN_D6, LCDPIN_D7 };
+
 // Currently displayed on screen; to save time and stop flicker when updating.
 char *screen_buffer;
 
+// Most recent frame passed to lcd_update, waiting to be written to the LCD by
+// the writer thread.
+char *back_buffer;
+
+// The frame the writer thread is writing, copied from back_buffer.
+char *writer_frame;
+
+// Set when back_buffer holds a frame that has not been written yet.
+int back_buffer_dirty;
+
+// Set by lcd_clear when the writer thread should clear the display.
+int clear_pending;
+
+// Set by lcd_close to stop the writer thread once pending output is written.
+int writer_stop;
+
+// Protects back_buffer and the flags above.
+pthread_mutex_t frame_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Number of commands used to write the last frame.
+int last_flush_commands;
+
+// Time the frame in back_buffer was published.
+unsigned long long back_buffer_time;
+
+// Every frame passed to lcd_update is written here if RPILCD_RECORD names a
+// file, so the frames can be replayed by lcd_bench.
+FILE *record_file;
+
+// Counters reported by lcd_get_stats (protected by frame_mutex).
+struct lcd_stats_t stats;
+
+// Counters for the bus output since they were last added to stats.  Only used
+// by the thread writing to the LCD, so no lock is needed.
+struct lcd_stats_t bus_stats;
+
+// Signalled when a new frame is published or the writer should stop.
+pthread_cond_t frame_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * A custom character held in one of the LCD's CGRAM slots.
+ */
+struct lcd_glyph_slot_t
+{
+    unsigned char bitmap[8];
+    // Set if the slot holds a glyph, if it must never be replaced and if the
+    // bitmap has not been written to CGRAM yet.
+    int used, pinned, dirty;
+    // Value of glyph_clock when the glyph was last used.
+    unsigned long last_used;
+};
+
+// The CGRAM slots (protected by frame_mutex).
+struct lcd_glyph_slot_t glyph_slot[LCD_GLYPHS];
+
+// Incremented for each frame published.  Glyphs used by the frame being
+// composed have last_used == glyph_clock and are not replaced.
+unsigned long glyph_clock = 1;
+
+// Thread writing frames to the LCD; the only user of the bus after lcd_init.
+pthread_t writer_pthread;
+int writer_running;
+
+// Set while the writer thread is writing a frame.
+int writer_busy;
+
+// Signalled when the writer thread has nothing left to write.
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Dimensions and DDRAM layout of a type of screen.
+ */
+struct lcd_geometry_t
+{
+    const char *name;
+    int width, height;
+    // Number of lines the controller is configured for (function set N bit).
+    int lines;
+    // DDRAM address of the first character of each row.
+    unsigned char row_addr[4];
+};
+
+const struct lcd_geometry_t lcd_geometry[] = {
+    [LCD_4X20] = { "4x20", 20, 4, 2, { 0x00, 0x40, 0x14, 0x54 } },
+    [LCD_2X16] = { "2x16", 16, 2, 2, { 0x00, 0x40 } },
+    [LCD_1X8]  = { "1x8",   8, 1, 1, { 0x00 } },
+    [LCD_1X16] = { "1x16", 16, 1, 1, { 0x00 } },
+    [LCD_2X20] = { "2x20", 20, 2, 2, { 0x00, 0x40 } },
+    [LCD_2X40] = { "2x40", 40, 2, 2, { 0x00, 0x40 } },
+    [LCD_4X16] = { "4x16", 16, 4, 2, { 0x00, 0x40, 0x10, 0x50 } }
+};
+
 // Screen type - determines buffer size and memory address offsets.
 enum lcd_screen_type_t lcd_screen_type;
 
-#define LCD_DELAY   1
+// Geometry of the screen in use.
+const struct lcd_geometry_t *geometry;
 
-#ifdef SIMULATE_LCD
-void lcd_cmd(unsigned char c, int char_mode)
+// DDRAM address of each position on the screen, and the position shown at
+// each DDRAM address (-1 if the address is not visible).  Built by lcd_init.
+unsigned char pos_addr[LCD_MAX_SIZE];
+signed char addr_pos[128];
+
+// HD44780 execution times in microseconds (datasheet values, 270kHz
+// oscillator).  Clear display and return home are the only slow instructions.
+#define LCD_EXEC_US         37
+#define LCD_EXEC_HOME_US    1520
+// Width of the E pulse and set-up time before it.  The datasheet minimums are
+// 450ns and 140ns; one microsecond is the shortest delay available.
+#define LCD_PULSE_US        1
+// Delays required by the initialisation sequence (by instruction).
+#define LCD_POWER_ON_US     40000
+#define LCD_INIT_FIRST_US   4100
+#define LCD_INIT_NEXT_US    100
+
+// Longest wait for the busy flag to clear, longer than any instruction takes.
+#define LCD_BUSY_TIMEOUT_US 2000
+
+// Time (from lcd_time_us) at which the LCD will have finished executing the
+// last instruction written to it.
+unsigned long long lcd_ready_at;
+
+// Set once the initialisation sequence has put the LCD in its final bus mode
+// (4 or 8-bit), after which the busy flag can be read if the backend is able
+// to.  Cleared if the flag does not clear in time.
+int lcd_busy_readable;
+
+unsigned long long lcd_time_us()
 {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
 }
-#else // SIMULATE_LCD
-void lcd_cmd(unsigned char c, int char_mode)
+
+int lcd_exec_us(unsigned char c, int char_mode)
+{
+    // 0x01 (clear display) and 0x02/0x03 (return home) take 1.52ms, every
+    // other instruction and all data writes take 37us.
+    if (!char_mode && (c & 0xfc) == 0) return LCD_EXEC_HOME_US;
+    return LCD_EXEC_US;
+}
+
+#ifndef SIMULATE_LCD
+// GPSET0/GPCLR0 bits for each nibble value on D4-D7, and the bits covering
+// D4-D7 and RS.  Built from lcdpin[] by gpio_init_masks.
+uint32_t lcd_nibble_bits[16];
+uint32_t lcd_bus_bits;
+
+void gpio_init_masks()
+{
+    int n = 0, i = 0;
+    for (n = 0; n < 16; n++)
+    {
+        lcd_nibble_bits[n] = 0;
+        for (i = 0; i < 4; i++)
+            if ((n >> i) & 1) lcd_nibble_bits[n] |= 1 << lcdpin[i];
+    }
+    lcd_bus_bits = lcd_nibble_bits[0x0f] | (1 << LCDPIN_RS);
+}
+
+int gpio_init(const char *arg)
 {
     int i = 0;
-    bcm2835_delay(LCD_DELAY);
-    bcm2835_gpio_write(LCDPIN_RS, char_mode);
+    for (i = 0; i < 4; i++)
+        bcm2835_gpio_fsel(lcdpin[i], BCM2835_GPIO_FSEL_OUTP);
+    bcm2835_gpio_fsel(LCDPIN_RS, BCM2835_GPIO_FSEL_OUTP);
+    bcm2835_gpio_fsel(LCDPIN_E, BCM2835_GPIO_FSEL_OUTP);
+    gpio_init_masks();
+#ifdef LCDPIN_RW
+    bcm2835_gpio_fsel(LCDPIN_RW, BCM2835_GPIO_FSEL_OUTP);
+    bcm2835_gpio_write(LCDPIN_RW, LOW);
+#endif
+    return 0;
+}
 
-    for (i = 0; i < 4; i++) bcm2835_gpio_write(lcdpin[i], 0);
-    for (i = 0; i < 4; i++) bcm2835_gpio_write(lcdpin[i], ((c >> (i + 4)) & 1));
+void gpio_delay_us(int us)
+{
+    bcm2835_delayMicroseconds(us);
+}
+
+// Write the low four bits of n to D4-D7 and strobe E.  The data pins and RS
+// are set and cleared together with one masked write.
+void gpio_write_nibble(unsigned char n, int char_mode)
+{
+    bcm2835_gpio_write_mask(
+        lcd_nibble_bits[n & 0x0f] | (char_mode ? (1 << LCDPIN_RS) : 0),
+        lcd_bus_bits
+        );
 
+    bcm2835_delayMicroseconds(LCD_PULSE_US);
     bcm2835_gpio_write(LCDPIN_E, HIGH);
-    bcm2835_delay(LCD_DELAY);
+    bcm2835_delayMicroseconds(LCD_PULSE_US);
     bcm2835_gpio_write(LCDPIN_E, LOW);
+}
 
-    for (i = 0; i < 4; i++) bcm2835_gpio_write(lcdpin[i], 0);
-    for (i = 0; i < 4; i++) bcm2835_gpio_write(lcdpin[i], ((c >> i) & 1));
+void gpio_write_byte(unsigned char c, int char_mode)
+{
+    gpio_write_nibble(c >> 4, char_mode);
+    gpio_write_nibble(c & 0x0f, char_mode);
+}
+
+#ifdef LCDPIN_RW
+// Read the busy flag (D7 of the status register) from an LCD connected to the
+// given data pins.  In 4-bit mode the status register is read as two nibbles
+// and the busy flag is in the first.
+int gpio_read_busy_pins(const int *pins, int n_pins)
+{
+    int i = 0, busy = 0;
+    for (i = 0; i < n_pins; i++)
+        bcm2835_gpio_fsel(pins[i], BCM2835_GPIO_FSEL_INPT);
+    bcm2835_gpio_write(LCDPIN_RS, LOW);
+    bcm2835_gpio_write(LCDPIN_RW, HIGH);
 
     bcm2835_gpio_write(LCDPIN_E, HIGH);
-    bcm2835_delay(LCD_DELAY);
+    bcm2835_delayMicroseconds(LCD_PULSE_US);
+    busy = (bcm2835_gpio_lev(LCDPIN_D7) == HIGH);
     bcm2835_gpio_write(LCDPIN_E, LOW);
+    if (n_pins == 4)
+    {
+        // Low nibble must be clocked out but is not needed.
+        bcm2835_delayMicroseconds(LCD_PULSE_US);
+        bcm2835_gpio_write(LCDPIN_E, HIGH);
+        bcm2835_delayMicroseconds(LCD_PULSE_US);
+        bcm2835_gpio_write(LCDPIN_E, LOW);
+    }
+
+    bcm2835_gpio_write(LCDPIN_RW, LOW);
+    for (i = 0; i < n_pins; i++)
+        bcm2835_gpio_fsel(pins[i], BCM2835_GPIO_FSEL_OUTP);
+    return busy;
+}
+
+int gpio_read_busy()
+{
+    return gpio_read_busy_pins(lcdpin, 4);
+}
+#endif // LCDPIN_RW
+
+void gpio_close()
+{
+}
 
-    bcm2835_delay(LCD_DELAY);
+const struct lcd_backend_t lcd_backend_gpio = {
+    "gpio",
+    4,
+    &gpio_init,
+    &gpio_delay_us,
+    &gpio_write_nibble,
+    &gpio_write_byte,
+#ifdef LCDPIN_RW
+    &gpio_read_busy,
+#else
+    0,
+#endif
+    &gpio_close,
+    0
+};
+
+// GPSET0/GPCLR0 bits for each byte on D0-D7, and the bits covering D0-D7 and
+// RS, for the 8-bit backend.
+uint32_t lcd_byte_bits[256];
+uint32_t lcd_bus8_bits;
+
+int gpio8_init(const char *arg)
+{
+    int c = 0, i = 0;
+    for (i = 0; i < 8; i++)
+        bcm2835_gpio_fsel(lcdpin8[i], BCM2835_GPIO_FSEL_OUTP);
+    bcm2835_gpio_fsel(LCDPIN_RS, BCM2835_GPIO_FSEL_OUTP);
+    bcm2835_gpio_fsel(LCDPIN_E, BCM2835_GPIO_FSEL_OUTP);
+    for (c = 0; c < 256; c++)
+    {
+        lcd_byte_bits[c] = 0;
+        for (i = 0; i < 8; i++)
+            if ((c >> i) & 1) lcd_byte_bits[c] |= 1 << lcdpin8[i];
+    }
+    lcd_bus8_bits = lcd_byte_bits[0xff] | (1 << LCDPIN_RS);
+#ifdef LCDPIN_RW
+    bcm2835_gpio_fsel(LCDPIN_RW, BCM2835_GPIO_FSEL_OUTP);
+    bcm2835_gpio_write(LCDPIN_RW, LOW);
+#endif
+    return 0;
 }
+
+// Write a whole byte to D0-D7 with one masked write and a single E strobe.
+void gpio8_write_byte(unsigned char c, int char_mode)
+{
+    bcm2835_gpio_write_mask(
+        lcd_byte_bits[c] | (char_mode ? (1 << LCDPIN_RS) : 0),
+        lcd_bus8_bits
+        );
+
+    bcm2835_delayMicroseconds(LCD_PULSE_US);
+    bcm2835_gpio_write(LCDPIN_E, HIGH);
+    bcm2835_delayMicroseconds(LCD_PULSE_US);
+    bcm2835_gpio_write(LCDPIN_E, LOW);
+}
+
+// A nibble on D4-D7 with D0-D3 low.
+void gpio8_write_nibble(unsigned char n, int char_mode)
+{
+    gpio8_write_byte((n & 0x0f) << 4, char_mode);
+}
+
+#ifdef LCDPIN_RW
+int gpio8_read_busy()
+{
+    return gpio_read_busy_pins(lcdpin8, 8);
+}
+#endif // LCDPIN_RW
+
+const struct lcd_backend_t lcd_backend_gpio8 = {
+    "gpio8",
+    8,
+    &gpio8_init,
+    &gpio_delay_us,
+    &gpio8_write_nibble,
+    &gpio8_write_byte,
+#ifdef LCDPIN_RW
+    &gpio8_read_busy,
+#else
+    0,
+#endif
+    &gpio_close,
+    0
+};
 #endif // SIMULATE_LCD
 
-int lcd_pos_to_addr(int pos)
+// The simulated backends drive the HD44780 model in hd44780_sim.c.  There is
+// no real LCD to wait for, so delays return immediately.
+int sim_init(const char *arg)
+{
+    hd44780_reset(&hd44780_sim);
+    return 0;
+}
+
+void sim_delay_us(int us)
 {
-    switch (lcd_screen_type)
+}
+
+void sim_write_nibble(unsigned char n, int char_mode)
+{
+    hd44780_strobe(&hd44780_sim, (n & 0x0f) << 4, char_mode);
+}
+
+void sim_write_byte(unsigned char c, int char_mode)
+{
+    hd44780_strobe(&hd44780_sim, c & 0xf0, char_mode);
+    hd44780_strobe(&hd44780_sim, c << 4, char_mode);
+}
+
+void sim8_write_byte(unsigned char c, int char_mode)
+{
+    hd44780_strobe(&hd44780_sim, c, char_mode);
+}
+
+void sim_close()
+{
+}
+
+const struct lcd_backend_t lcd_backend_sim = {
+    "sim",
+    4,
+    &sim_init,
+    &sim_delay_us,
+    &sim_write_nibble,
+    &sim_write_byte,
+    0,
+    &sim_close,
+    0
+};
+
+const struct lcd_backend_t lcd_backend_sim8 = {
+    "sim8",
+    8,
+    &sim_init,
+    &sim_delay_us,
+    &sim_write_nibble,
+    &sim8_write_byte,
+    0,
+    &sim_close,
+    0
+};
+
+void lcd_sim_read(char *s)
+{
+    int i = 0;
+    for (i = 0; i < lcd_size(); i++)
+        s[i] = hd44780_sim.ddram[lcd_pos_to_addr(i)];
+}
+
+// Backends that can be chosen with lcd_set_backend.
+const struct lcd_backend_t *lcd_backends[] = {
+#ifndef SIMULATE_LCD
+    &lcd_backend_gpio,
+    &lcd_backend_gpio8,
+#endif
+    &lcd_backend_sim,
+    &lcd_backend_sim8,
+    &lcd_backend_term,
+    &lcd_backend_i2c,
+    &lcd_backend_i2c_mock,
+    0
+};
+
+// The backend in use, and the argument given to its init function.
+#ifdef SIMULATE_LCD
+const struct lcd_backend_t *backend = &lcd_backend_term;
+#else
+const struct lcd_backend_t *backend = &lcd_backend_gpio;
+#endif
+char *backend_arg;
+
+int lcd_set_backend(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    int len = colon ? colon - spec : strlen(spec);
+    int i = 0;
+    for (i = 0; lcd_backends[i]; i++)
     {
-        case LCD_4X20:
-        switch (pos/20)
+        if (strlen(lcd_backends[i]->name) == len &&
+                strncmp(lcd_backends[i]->name, spec, len) == 0)
         {
-            case 0:
-            return 128 + (pos%20);
-            case 1:
-            return 192 + (pos%20);
-            case 2:
-            return 148 + (pos%20);
-            case 3:
-            return 212 + (pos%20);
+            backend = lcd_backends[i];
+            free(backend_arg);
+            backend_arg = colon ? strdup(colon + 1) : 0;
+            return 0;
         }
-        case LCD_2X16:
-        switch (pos/16)
+    }
+    return 1;
+}
+
+void lcd_delay_us(int us)
+{
+    backend->delay_us(us);
+}
+
+void lcd_nibble(unsigned char n, int char_mode)
+{
+    backend->write_nibble(n, char_mode);
+    bus_stats.commands++;
+}
+
+// Add the bus counters to stats.  frame_mutex must be locked.
+void lcd_merge_stats()
+{
+    stats.commands += bus_stats.commands;
+    stats.data += bus_stats.data;
+    stats.bytes += bus_stats.bytes;
+    stats.bus_us += bus_stats.bus_us;
+    stats.skipped += bus_stats.skipped;
+    memset(&bus_stats, 0, sizeof(bus_stats));
+}
+
+// Wait until the LCD has finished executing the last instruction.
+void lcd_wait_ready(unsigned long long now)
+{
+    if (lcd_busy_readable && backend->read_busy)
+    {
+        while (backend->read_busy())
         {
-            case 0:
-            return 128 + (pos%16);
-            case 1:
-            return 192 + (pos%16);
+            // A disconnected RW line or a dead controller would hold the
+            // flag forever; go back to the worst case timings.
+            if (lcd_time_us() - now > LCD_BUSY_TIMEOUT_US)
+            {
+                fprintf(stderr, "LCD busy flag stuck, using fixed delays\n");
+                lcd_busy_readable = 0;
+                break;
+            }
         }
+        if (lcd_busy_readable) return;
     }
+    if (now < lcd_ready_at) lcd_delay_us(lcd_ready_at - now);
 }
 
-void lcd_line(const char* line, int n)
+void lcd_cmd(unsigned char c, int char_mode)
 {
-	int i = 0;
-    // If line is null, print a line of n spaces.
-    if (line == 0)
+    // Time spent by the caller since the last instruction counts towards its
+    // execution time, so only wait for whatever is left.
+    unsigned long long start = lcd_time_us();
+    lcd_wait_ready(start);
+    backend->write_byte(c, char_mode);
+    unsigned long long end = lcd_time_us();
+    lcd_ready_at = end + lcd_exec_us(c, char_mode);
+
+    if (char_mode) bus_stats.data++;
+    else bus_stats.commands++;
+    bus_stats.bytes++;
+    bus_stats.bus_us += end - start;
+}
+
+int lcd_pos_to_addr(int pos)
+{
+    return pos_addr[pos];
+}
+
+void lcd_init_geometry(enum lcd_screen_type_t t)
+{
+    int i = 0;
+    lcd_screen_type = t;
+    geometry = &lcd_geometry[t];
+    memset(addr_pos, -1, sizeof(addr_pos));
+    for (i = 0; i < lcd_size(); i++)
     {
-        fprintf(stderr, "|%-*s|\n", n, "");
-        for (i = 0; i < n; i++) lcd_cmd(' ', 1);
-        return;
+        pos_addr[i] = geometry->row_addr[i / geometry->width] +
+            i % geometry->width;
+        addr_pos[pos_addr[i]] = i;
     }
+}
 
-    int len = strlen(line);
+int lcd_screen_type_from_name(const char *name, enum lcd_screen_type_t *t)
+{
+    int i = 0;
+    for (i = 0; i < sizeof(lcd_geometry)/sizeof(lcd_geometry[0]); i++)
+    {
+        if (strcmp(name, lcd_geometry[i].name) == 0)
+        {
+            *t = i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void lcd_line(const char* line, int n)
+{
+	int i = 0;
+    // If line is null, write a line of n spaces.
+    int len = line ? strlen(line) : 0;
     len = (len > n)?n:len;
+    for (i = 0; i < n; i++) lcd_cmd((i < len)?line[i]:' ', 1);
+}
 
-    // %-*s pads spaces but does not limit the length of a line.
-    char *line_dup = strdup(line);
-    if (strlen(line) > n) line_dup[n] = 0;
-	fprintf(stderr, "|%-*s|\n", n, line_dup);
-    free(line_dup);
+// Write n lines of text to the screen, padding or truncating each line to
+// the width of the screen.
+void lcd_lines(const char **lines, int n)
+{
+    char s[LCD_MAX_SIZE];
+    int row = 0, i = 0;
+    for (row = 0; row < n; row++)
+    {
+        const char *line = lines[row] ? lines[row] : "";
+        char *dest = &s[row * lcd_width()];
+        for (i = 0; i < lcd_width() && line[i]; i++) dest[i] = line[i];
+        for (; i < lcd_width(); i++) dest[i] = ' ';
+    }
+    lcd_update((char*)&s);
+}
 
-    for (i = 0; i < n; i++) lcd_cmd((i < len)?line[i]:' ', 1);
+void lcd_1line(const char* s1)
+{
+    if (lcd_height() != 1) return;
+    const char *lines[] = { s1 };
+    lcd_lines(lines, 1);
 }
 
 void lcd_2line(const char* s1, const char* s2)
 {
     if (lcd_height() != 2) return;
-#ifdef SIMULATE_LCD
-	fprintf(stderr, "+----------------+\n");
-    fprintf(stderr, "|%-*s|\n", lcd_width(), s1);
-    fprintf(stderr, "|%-*s|\n", lcd_width(), s2);
-	fprintf(stderr, "+----------------+\n");
-#endif
-    char s[81];
-    snprintf((char*)&s[0], 17, "%-*s", 17, s1);
-    snprintf((char*)&s[16], 17, "%-*s", 17, s2);
-    lcd_update((char*)&s);
+    const char *lines[] = { s1, s2 };
+    lcd_lines(lines, 2);
 }
 
 void lcd_4line(const char* s1, const char* s2, const char* s3, const char* s4)
 {
     if (lcd_height() != 4) return;
-#ifdef SIMULATE_LCD
-	fprintf(stderr, "+--------------------+\n");
-    fprintf(stderr, "|%-*s|\n", lcd_width(), s1);
-    fprintf(stderr, "|%-*s|\n", lcd_width(), s2);
-    fprintf(stderr, "|%-*s|\n", lcd_width(), s3);
-    fprintf(stderr, "|%-*s|\n", lcd_width(), s4);
-	fprintf(stderr, "+--------------------+\n");
-#endif
-    char s[81];
-    snprintf((char*)&s[0], 21, "%-*s", 21, s1);
-    snprintf((char*)&s[20], 21, "%-*s", 21, s2);
-    snprintf((char*)&s[40], 21, "%-*s", 21, s3);
-    snprintf((char*)&s[60], 21, "%-*s", 21, s4);
-    lcd_update((char*)&s);
-#ifdef SIMULATE_LCD
-    fprintf(stderr, "-- %s --\n", (char*)&s);
-#endif
+    const char *lines[] = { s1, s2, s3, s4 };
+    lcd_lines(lines, 4);
 }
 
 int lcd_size()
 {
-    switch (lcd_screen_type)
-    {
-        case LCD_4X20: return 80;
-        case LCD_2X16: return 32;
-    }
+    return geometry->width * geometry->height;
 }
 
 int lcd_width()
 {
-    switch (lcd_screen_type)
+    return geometry->width;
+}
+
+int lcd_height()
+{
+    return geometry->height;
+}
+
+// Relative cost of the commands used to write a frame.  A set DDRAM address
+// command and a data write take the same time on the HD44780.
+#define LCD_COST_ADDR   1
+#define LCD_COST_DATA   1
+
+// Map a DDRAM address back to a position on the screen, or -1 if the address
+// is not visible.
+int lcd_addr_to_pos(int addr)
+{
+    return addr_pos[addr];
+}
+
+// The DDRAM address following addr.  In 2 line mode the address counter moves
+// from the end of the first line to the start of the second line and back, in
+// 1 line mode it wraps at the end of the only line.
+int lcd_next_addr(int addr)
+{
+    if (geometry->lines == 1) return (addr == 0x4f) ? 0x00 : addr + 1;
+    if (addr == 0x27) return 0x40;
+    if (addr == 0x67) return 0x00;
+    return addr + 1;
+}
+
+// Write the differences between s and screen_buffer to the LCD using as few
+// commands as possible, and return the number of commands written.  Only
+// called by the writer thread (or before it is started).
+int lcd_flush(const char* s)
+{
+    int i = 0, n = 0;
+    // DDRAM address the next data write will go to, -1 if not known.
+    int ac = -1;
+    for (i = 0; i < lcd_size(); i++)
     {
-        case LCD_4X20: return 20;
-        case LCD_2X16: return 16;
+        if (s[i] == screen_buffer[i])
+        {
+            bus_stats.skipped++;
+            continue;
+        }
+        int addr = pos_addr[i];
+
+        // Rewriting the unchanged characters between the address counter and
+        // addr is cheaper than moving the address counter if the gap is
+        // short enough.
+        int gap = -1;
+        if (ac >= 0 && addr >= ac &&
+                (addr - ac) * LCD_COST_DATA <= LCD_COST_ADDR)
+        {
+            int a = 0;
+            gap = addr - ac;
+            for (a = ac; a < addr; a++)
+                if (lcd_addr_to_pos(a) < 0) gap = -1;
+        }
+        if (gap > 0)
+        {
+            for (; ac < addr; ac = lcd_next_addr(ac))
+            {
+                int p = lcd_addr_to_pos(ac);
+                lcd_cmd(s[p], 1);
+                screen_buffer[p] = s[p];
+                bus_stats.skipped--;
+                n++;
+            }
+        } else if (gap < 0)
+        {
+            lcd_cmd(0x80 | addr, 0);
+            n++;
+        }
+
+        lcd_cmd(s[i], 1);
+        screen_buffer[i] = s[i];
+        n++;
+        ac = lcd_next_addr(addr);
     }
+    return n;
 }
 
-int lcd_height()
+// Write the glyphs selected by the bits of upload to CGRAM.  Consecutive
+// slots are written with one set address command.
+void lcd_write_glyphs(unsigned char glyphs[][8], int upload)
 {
-    switch (lcd_screen_type)
+    int i = 0, j = 0, next = -1;
+    for (i = 0; i < LCD_GLYPHS; i++)
     {
-        case LCD_4X20: return 4;
-        case LCD_2X16: return 2;
+        if (!(upload & (1 << i))) continue;
+        if (next != i) lcd_cmd(0x40 | (i << 3), 0);
+        for (j = 0; j < 8; j++) lcd_cmd(glyphs[i][j], 1);
+        next = i + 1;
     }
 }
 
-void lcd_update(const char* s)
+void *writer_thread(void *v)
 {
-    int i = 0;
-    while(i < lcd_size())
+    char *frame = writer_frame;
+    pthread_mutex_lock(&frame_mutex);
+    while (1)
     {
-        if(s[i] != screen_buffer[i])
+        while (!back_buffer_dirty && !clear_pending && !writer_stop)
+        {
+            writer_busy = 0;
+            pthread_cond_broadcast(&idle_cond);
+            pthread_cond_wait(&frame_cond, &frame_mutex);
+        }
+        if (!back_buffer_dirty && !clear_pending) break;
+        writer_busy = 1;
+
+        // Take the latest frame; any published while this one is being
+        // written replace it, so the LCD never falls behind.
+        int clear = clear_pending, dirty = back_buffer_dirty;
+        unsigned long long published = back_buffer_time;
+        memcpy(frame, back_buffer, lcd_size());
+        clear_pending = 0;
+        back_buffer_dirty = 0;
+        // Glyphs must be in CGRAM before the frame using them is written.
+        unsigned char glyphs[LCD_GLYPHS][8];
+        int i = 0, upload = 0;
+        for (i = 0; i < LCD_GLYPHS; i++)
+        {
+            if (glyph_slot[i].dirty)
+            {
+                memcpy(glyphs[i], glyph_slot[i].bitmap, 8);
+                glyph_slot[i].dirty = 0;
+                upload |= 1 << i;
+            }
+        }
+        pthread_mutex_unlock(&frame_mutex);
+
+        lcd_write_glyphs(glyphs, upload);
+
+        if (clear)
+        {
+            lcd_cmd(0x01, 0);
+            memset(screen_buffer, ' ', lcd_size());
+        }
+        int n = dirty ? lcd_flush(frame) : 0;
+        if (backend->flushed) backend->flushed();
+
+        unsigned long long latency = lcd_time_us() - published;
+
+        pthread_mutex_lock(&frame_mutex);
+        lcd_merge_stats();
+        if (dirty)
         {
-            // Move to i on the screen.
-            lcd_cmd(lcd_pos_to_addr(i), 0);
-            lcd_cmd(s[i], 1);
-            screen_buffer[i] = s[i];
-            i++;
-            while(
-                    s[i] != screen_buffer[i] &&
-                    i < lcd_size() && i%lcd_width() != 0
-                    )
+            last_flush_commands = n;
+            stats.frames++;
+            // Bucket i counts frames taking less than 2^(i+1)us.
+            int bucket = 0;
+            while (latency > 1 && bucket < LCD_LATENCY_BUCKETS - 1)
             {
-                lcd_cmd(s[i], 1);
-                screen_buffer[i] = s[i];
-                i++;
+                latency >>= 1;
+                bucket++;
             }
-        } else i++;
+            stats.latency[bucket]++;
+        }
     }
+    writer_busy = 0;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&frame_mutex);
+    return 0;
 }
 
-int lcd_init(enum lcd_screen_type_t t)
+// Find the slot holding bitmap, or choose one to load it into.  Returns -1 if
+// every slot is pinned or used by the frame being composed.
+int lcd_glyph_slot(const unsigned char *bitmap)
 {
-    lcd_screen_type = t;
-    switch (lcd_screen_type)
+    int i = 0, victim = -1;
+    for (i = 0; i < LCD_GLYPHS; i++)
+    {
+        if (glyph_slot[i].used && memcmp(glyph_slot[i].bitmap, bitmap, 8) == 0)
+            return i;
+    }
+    // Least recently used replaceable slot (empty slots were last used at 0).
+    for (i = 0; i < LCD_GLYPHS; i++)
+    {
+        if (glyph_slot[i].pinned || glyph_slot[i].last_used == glyph_clock)
+            continue;
+        if (victim < 0 ||
+                glyph_slot[i].last_used < glyph_slot[victim].last_used)
+            victim = i;
+    }
+    if (victim < 0) return -1;
+    memcpy(glyph_slot[victim].bitmap, bitmap, 8);
+    glyph_slot[victim].used = 1;
+    glyph_slot[victim].dirty = 1;
+    return victim;
+}
+
+char lcd_glyph(const unsigned char *bitmap, char fallback)
+{
+    pthread_mutex_lock(&frame_mutex);
+    int i = lcd_glyph_slot(bitmap);
+    if (i >= 0) glyph_slot[i].last_used = glyph_clock;
+    pthread_mutex_unlock(&frame_mutex);
+    // Codes 0x08-0x0f show the same glyphs as 0x00-0x07, and can be used in
+    // strings.
+    return (i < 0) ? fallback : (char)(LCD_GLYPHS + i);
+}
+
+char lcd_glyph_pin(const unsigned char *bitmap, char fallback)
+{
+    pthread_mutex_lock(&frame_mutex);
+    int i = lcd_glyph_slot(bitmap);
+    if (i >= 0) glyph_slot[i].pinned = 1;
+    pthread_mutex_unlock(&frame_mutex);
+    return (i < 0) ? fallback : (char)(LCD_GLYPHS + i);
+}
+
+void lcd_update(const char* s)
+{
+    lcd_update_range(0, s, lcd_size());
+}
+
+void lcd_update_range(int pos, const char *s, int len)
+{
+    pthread_mutex_lock(&frame_mutex);
+    // A frame still waiting is replaced without being written.
+    if (back_buffer_dirty) stats.dropped++;
+    memcpy(back_buffer + pos, s, len);
+    back_buffer_dirty = 1;
+    back_buffer_time = lcd_time_us();
+    glyph_clock++;
+    if (record_file)
     {
-    case LCD_4X20:
-        screen_buffer = malloc(80);
-        memset(screen_buffer, ' ', 80);
-        break;
-    case LCD_2X16:
-        screen_buffer = malloc(32);
-        memset(screen_buffer, ' ', 32);
-        break;
+        int row = 0;
+        for (row = 0; row < lcd_height(); row++)
+        {
+            fwrite(back_buffer + row * lcd_width(), 1, lcd_width(),
+                record_file);
+            fputc('\n', record_file);
+        }
     }
+    pthread_cond_signal(&frame_cond);
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+int lcd_last_flush_commands()
+{
+    pthread_mutex_lock(&frame_mutex);
+    int n = last_flush_commands;
+    pthread_mutex_unlock(&frame_mutex);
+    return n;
+}
+
+void lcd_sync()
+{
+    pthread_mutex_lock(&frame_mutex);
+    while (writer_running &&
+            (back_buffer_dirty || clear_pending || writer_busy))
+        pthread_cond_wait(&idle_cond, &frame_mutex);
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+void lcd_get_stats(struct lcd_stats_t *s)
+{
+    pthread_mutex_lock(&frame_mutex);
+    *s = stats;
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+void lcd_reset_stats()
+{
+    pthread_mutex_lock(&frame_mutex);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+void lcd_print_stats()
+{
+    struct lcd_stats_t s;
+    int i = 0;
+    lcd_get_stats(&s);
+    fprintf(stderr,
+        "LCD: %lu frames written, %lu dropped, %lu commands, %lu characters, "
+        "%lu bytes, %lluus on the bus, %lu characters skipped\n",
+        s.frames, s.dropped, s.commands, s.data, s.bytes, s.bus_us,
+        s.skipped);
+    fprintf(stderr, "LCD frame latency:\n");
+    for (i = 0; i < LCD_LATENCY_BUCKETS; i++)
+    {
+        if (s.latency[i] == 0) continue;
+        fprintf(stderr, "  < %8luus: %lu\n", 2UL << i, s.latency[i]);
+    }
+}
 
 #ifndef SIMULATE_LCD
+// 1 once the BCM2835 registers are mapped and the button pins set up, -1 if
+// that failed.  Set under gpio_mutex, as lcd_init and the button thread can
+// both be first.
+int gpio_state;
+pthread_mutex_t gpio_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Map the registers and set up the button pins.  Called with gpio_mutex
+// held.  Returns the new gpio_state.
+int lcd_gpio_map()
+{
     if (!bcm2835_init())
     {
         fprintf(stderr, "Error initialising BCM2835\n");
-        return 1;
+        return -1;
     }
 
-    int i = 0;
-    for (i = 0; i < 4; i++)
-        bcm2835_gpio_fsel(lcdpin[i], BCM2835_GPIO_FSEL_OUTP);
-    bcm2835_gpio_fsel(LCDPIN_RS, BCM2835_GPIO_FSEL_OUTP);
-    bcm2835_gpio_fsel(LCDPIN_E, BCM2835_GPIO_FSEL_OUTP);
-
     bcm2835_gpio_fsel(LCD_BUTTON_VOLUP, BCM2835_GPIO_FSEL_INPT);
     bcm2835_gpio_fsel(LCD_BUTTON_FILE, BCM2835_GPIO_FSEL_INPT);
 
@@ -254,53 +961,173 @@ int lcd_init(enum lcd_screen_type_t t)
 
     bcm2835_gpio_fsel(LCD_BUTTON_PLAY, BCM2835_GPIO_FSEL_INPT);
     bcm2835_gpio_fsel(LCD_BUTTON_FF, BCM2835_GPIO_FSEL_INPT);
+    return 1;
+}
+
+int lcd_gpio_init()
+{
+    int state = __atomic_load_n(&gpio_state, __ATOMIC_ACQUIRE);
+    if (state == 0)
+    {
+        pthread_mutex_lock(&gpio_mutex);
+        if (gpio_state == 0)
+            __atomic_store_n(&gpio_state, lcd_gpio_map(), __ATOMIC_RELEASE);
+        state = gpio_state;
+        pthread_mutex_unlock(&gpio_mutex);
+    }
+    return (state == 1) ? 0 : 1;
+}
+#endif // SIMULATE_LCD
+
+int lcd_init(enum lcd_screen_type_t t)
+{
+    lcd_init_geometry(t);
+    memset(glyph_slot, 0, sizeof(glyph_slot));
+    memset(&stats, 0, sizeof(stats));
+    memset(&bus_stats, 0, sizeof(bus_stats));
+    screen_buffer = malloc(lcd_size());
+    back_buffer = malloc(lcd_size());
+    writer_frame = malloc(lcd_size());
+    if (!screen_buffer || !back_buffer || !writer_frame)
+    {
+        fprintf(stderr, "Out of memory for LCD buffers\n");
+        return 1;
+    }
+    memset(screen_buffer, ' ', lcd_size());
+    memset(back_buffer, ' ', lcd_size());
+
+#ifndef SIMULATE_LCD
+    // The other backends do not need the GPIO registers (or root), so they
+    // are only mapped for the buttons if poll_buttons is used.
+    if ((backend == &lcd_backend_gpio || backend == &lcd_backend_gpio8) &&
+        lcd_gpio_init() != 0) return 1;
 #endif // SIMULATE_LCD
 
+    if (backend->init(backend_arg) != 0)
+    {
+        fprintf(stderr, "Error initialising LCD backend %s\n", backend->name);
+        return 1;
+    }
+
     // Initialise HD44780.
 
-    // Set 8 bit mode, set 4 bit mode (must use an even number of commands
-    // because lcd_cmd sends two commands).
-    lcd_cmd(0x33, 0); // 0011 0011
-    lcd_cmd(0x32, 0); // 0011 0010
-    // Set all function settings - 4 bit, 1/16 duty, 5x10 dot font.
-    lcd_cmd(0x28, 0); // 0010 1000
+    // Set 8 bit mode three times.  The LCD may be in either mode (or half way
+    // through a 4 bit transfer) so on a 4 bit bus these are sent as single
+    // nibbles, then 4 bit mode is set.  The busy flag cannot be read until
+    // this is complete.
+    lcd_delay_us(LCD_POWER_ON_US);
+    if (backend->bus_width == 8)
+    {
+        backend->write_byte(0x30, 0);
+        lcd_delay_us(LCD_INIT_FIRST_US);
+        backend->write_byte(0x30, 0);
+        lcd_delay_us(LCD_INIT_NEXT_US);
+        backend->write_byte(0x30, 0);
+        lcd_delay_us(LCD_EXEC_US);
+    } else {
+        lcd_nibble(0x3, 0);
+        lcd_delay_us(LCD_INIT_FIRST_US);
+        lcd_nibble(0x3, 0);
+        lcd_delay_us(LCD_INIT_NEXT_US);
+        lcd_nibble(0x3, 0);
+        lcd_delay_us(LCD_EXEC_US);
+        lcd_nibble(0x2, 0);
+        lcd_delay_us(LCD_EXEC_US);
+    }
+    lcd_busy_readable = 1;
+    // Set all function settings - 4 or 8 bit, 1/16 duty (two lines) or 1/8
+    // duty (one line), 5x8 dot font.
+    lcd_cmd(
+        ((backend->bus_width == 8) ? 0x30 : 0x20) |
+        ((geometry->lines == 2) ? 0x08 : 0x00),
+        0); // 001D N000
     // Set display on, cursor off, not blinking.
     lcd_cmd(0x0c, 0); // 0000 1100
     // Set entry mode: cursor direction left to right, no display shift.
     lcd_cmd(0x06, 0); // 0000 0110
     // Clear display.
     lcd_cmd(0x01, 0); // 0000 0001
+
+    const char *record = getenv("RPILCD_RECORD");
+    if (record)
+    {
+        record_file = fopen(record, "w");
+        if (record_file) fprintf(record_file, "%s\n", geometry->name);
+    }
+
+    // The writer thread has not started, so frame_mutex is not needed.
+    lcd_merge_stats();
+
+    writer_stop = 0;
+    if (pthread_create(&writer_pthread, 0, &writer_thread, 0) != 0)
+    {
+        fprintf(stderr, "Error starting LCD writer thread\n");
+        return 1;
+    }
+    writer_running = 1;
     return 0;
 }
 
 void lcd_clear()
 {
-    // 0x01 clears the screen.
-    lcd_cmd(0x01, 0);
+    // The clear replaces any frame still waiting to be written.
+    pthread_mutex_lock(&frame_mutex);
+    memset(back_buffer, ' ', lcd_size());
+    back_buffer_dirty = 0;
+    clear_pending = 1;
+    pthread_cond_signal(&frame_cond);
+    pthread_mutex_unlock(&frame_mutex);
 }
 
 void lcd_close()
 {
+    if (writer_running)
+    {
+        pthread_mutex_lock(&frame_mutex);
+        writer_stop = 1;
+        pthread_cond_signal(&frame_cond);
+        pthread_mutex_unlock(&frame_mutex);
+        pthread_join(writer_pthread, 0);
+        writer_running = 0;
+    }
+    backend->close();
+    lcd_busy_readable = 0;
+    if (record_file) fclose(record_file);
+    record_file = 0;
+    free(screen_buffer);
+    free(back_buffer);
+    free(writer_frame);
+    screen_buffer = back_buffer = writer_frame = 0;
 #ifndef SIMULATE_LCD
-    bcm2835_close();
+    pthread_mutex_lock(&gpio_mutex);
+    if (gpio_state == 1) bcm2835_close();
+    __atomic_store_n(&gpio_state, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&gpio_mutex);
 #endif
 }
 
-int poll_button_press()
+unsigned int poll_buttons()
 {
 #ifndef SIMULATE_LCD
-    if (bcm2835_gpio_lev(LCD_BUTTON_VOLUP) == LOW) return LCD_BUTTON_VOLUP;
-    if (bcm2835_gpio_lev(LCD_BUTTON_FILE) == LOW) return LCD_BUTTON_FILE;
-
-    if (bcm2835_gpio_lev(LCD_BUTTON_NOW) == LOW) return LCD_BUTTON_NOW;
-    if (bcm2835_gpio_lev(LCD_BUTTON_VOL) == LOW) return LCD_BUTTON_VOL;
-
-    if (bcm2835_gpio_lev(LCD_BUTTON_VOLDOWN) == LOW) return LCD_BUTTON_VOLDOWN;
-    if (bcm2835_gpio_lev(LCD_BUTTON_RW) == LOW) return LCD_BUTTON_RW;
-
-    if (bcm2835_gpio_lev(LCD_BUTTON_PLAY) == LOW) return LCD_BUTTON_PLAY;
-    if (bcm2835_gpio_lev(LCD_BUTTON_FF) == LOW) return LCD_BUTTON_FF;
+    if (lcd_gpio_init() != 0) return 0;
+    // The buttons pull their pins low, and all of them are in GPLEV0.
+    return ~bcm2835_peri_read(bcm2835_gpio + BCM2835_GPLEV0/4) &
+        LCD_BUTTON_MASK;
+#else
+    return 0;
 #endif
-    return LCD_BUTTON_NONE;
 }
 
+int poll_button_press()
+{
+    unsigned int pressed = poll_buttons();
+    const int order[] = {
+        LCD_BUTTON_VOLUP, LCD_BUTTON_FILE, LCD_BUTTON_NOW, LCD_BUTTON_VOL,
+        LCD_BUTTON_VOLDOWN, LCD_BUTTON_RW, LCD_BUTTON_PLAY, LCD_BUTTON_FF };
+    int i = 0;
+    for (i = 0; i < 8; i++)
+    {
+        if (pressed & (1u << order[i])) return order[i];
+    }
+    return LCD_BUTTON_NONE;
+}
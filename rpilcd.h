@@ -19,6 +19,15 @@
 #define LCD_BUTTON_PLAY 18
 #define LCD_BUTTON_FF 17
 
+/*!
+ * GPIO level register bits of all the buttons.
+ */
+#define LCD_BUTTON_MASK \
+    ((1u << LCD_BUTTON_VOLUP) | (1u << LCD_BUTTON_FILE) | \
+     (1u << LCD_BUTTON_NOW) | (1u << LCD_BUTTON_VOL) | \
+     (1u << LCD_BUTTON_VOLDOWN) | (1u << LCD_BUTTON_RW) | \
+     (1u << LCD_BUTTON_PLAY) | (1u << LCD_BUTTON_FF))
+
 /*
  * Button Layout
  *   9  11   8   7
@@ -29,31 +38,110 @@
  * Dimensions of the LCD screen, used to allocate buffers and translate
  * coordinates to addresses.
  */
-enum lcd_screen_type_t { LCD_4X20, LCD_2X16 };
+enum lcd_screen_type_t
+{
+    LCD_4X20,
+    LCD_2X16,
+    LCD_1X8,
+    LCD_1X16,
+    LCD_2X20,
+    LCD_2X40,
+    LCD_4X16
+};
+/*!
+ * The largest number of characters any supported screen can display.
+ */
+#define LCD_MAX_SIZE 80
+/*!
+ * Look up a screen type by its name ("4x20", "2x16", "1x8", "1x16", "2x20",
+ * "2x40" or "4x16").
+ * \return 0 on success, 1 if the name is not recognised.
+ */
+int lcd_screen_type_from_name(const char*, enum lcd_screen_type_t*);
+/*!
+ * Choose how the LCD is connected.  Must be called before lcd_init.
+ *
+ * \param spec A backend name, optionally followed by ':' and an argument:
+ * "gpio" (the default, pins listed in rpilcd.c), "gpio8" (as gpio with all
+ * eight data lines connected, one transfer per byte), "sim" and "sim8" (a
+ * simulated LCD on a 4 or 8-bit bus, kept in memory only), "term" (the
+ * simulated LCD drawn on the terminal, the default when built with
+ * SIMULATE_LCD), "i2c[:device[:address]]" (a PCF8574 I2C backpack, for
+ * example "i2c:/dev/i2c-1:0x27") or "i2c-mock" (the I2C backend writing to a
+ * simulated PCF8574).
+ * \return 0 on success, 1 if the backend is not recognised.
+ */
+int lcd_set_backend(const char *spec);
+
+/*!
+ * Copy what the simulated LCD (the sim, sim8 and term backends) shows into
+ * s, lcd_size() characters in the same order as frames passed to
+ * lcd_update.  Call lcd_sync first to see the last frame.
+ */
+void lcd_sim_read(char *s);
 /*!
  * Initialise the LCD pins on the Raspberry Pi and clear the screen.
  */
 int lcd_init(enum lcd_screen_type_t);
 /*!
- * For use with 2x16 displays: write the two strings to the two lines of the
+ * For use with 1 line displays: write the string to the display.
+ * \note Calls to this function are ignored if the LCD is not a 1 line type.
+ */
+void lcd_1line(const char*);
+/*!
+ * For use with 2 line displays: write the two strings to the two lines of the
  * display.
  * \note Calls to this function are ignored if the LCD is not a 2 line type.
  */
 void lcd_2line(const char*, const char*);
 /*!
- * For use with 4x20 displays: write the four strings to the four lines of the
+ * For use with 4 line displays: write the four strings to the four lines of the
  * display.
  * \note Calls to this function are ignored if the LCD is not a 4 line type.
  */
 void lcd_4line(const char*, const char*, const char*, const char*);
 /*!
- * Clear the LCD.
+ * Number of custom characters the LCD can hold at once.
+ */
+#define LCD_GLYPHS 8
+/*!
+ * Get the character code for a custom character, loading it into the LCD if
+ * it is not already there.  The least recently used custom character is
+ * replaced if all are in use.
+ *
+ * \param bitmap Eight rows of five pixels (bit 4 is the leftmost column).
+ * \param fallback Returned instead if every custom character is pinned or
+ * used by the frame being composed.
+ * \return A character code to use in the next frame passed to lcd_update.
+ */
+char lcd_glyph(const unsigned char *bitmap, char fallback);
+/*!
+ * As lcd_glyph, but the custom character is never replaced.  Intended for
+ * glyphs that are used all the time, such as icons.
+ */
+char lcd_glyph_pin(const unsigned char *bitmap, char fallback);
+/*!
+ * Clear the LCD.  Like lcd_update, this returns without waiting for the LCD.
  */
 void lcd_clear();
 /*!
- * Stop the LCD output, leaving the display contents as is.
+ * Wait until every frame passed to lcd_update has been written to the LCD.
+ */
+void lcd_sync();
+/*!
+ * Write any output still pending and stop the LCD output, leaving the display
+ * contents as is.
  */
 void lcd_close();
+/*!
+ * Read the state of all the buttons with a single read of the GPIO level
+ * register.
+ * The GPIO registers are mapped on first use if the LCD backend did not
+ * need them.
+ * \return The buttons held down; bit n is set if the button on GPIO n
+ * (LCD_BUTTON_*) is pressed, or 0 if the registers cannot be mapped.
+ */
+unsigned int poll_buttons();
 /*!
  * Poll the state of the GPIO pins to discover if a single button is pressed.
  */
@@ -61,8 +149,65 @@ int poll_button_press();
 /*!
  * Update the content of the LCD to match the given string.  Only updates
  * characters that have changed.
+ *
+ * The string is copied and written to the LCD by a separate thread, so this
+ * does not wait for the LCD.  If frames are published faster than the LCD
+ * can be written, intermediate frames are dropped and only the latest is
+ * written.
  */
 void lcd_update(const char*);
+/*!
+ * As lcd_update, but replace only len characters starting at pos (row *
+ * width + column), leaving the rest of the last frame as it was.  After
+ * lcd_clear the rest of the frame is blank.
+ */
+void lcd_update_range(int pos, const char *s, int len);
+/*!
+ * \return The number of commands (set address and character writes) used to
+ * write the most recent frame to the LCD.
+ */
+int lcd_last_flush_commands();
+/*!
+ * Number of buckets in the frame latency histogram.
+ */
+#define LCD_LATENCY_BUCKETS 20
+/*!
+ * Counters describing the work done writing to the LCD.
+ */
+struct lcd_stats_t
+{
+    /*! Instructions and characters (including custom characters) written. */
+    unsigned long commands, data;
+    /*! Bytes written to the bus. */
+    unsigned long bytes;
+    /*! Time spent writing to the bus, including waiting for the LCD. */
+    unsigned long long bus_us;
+    /*! Frames written, and frames replaced by a newer one before they could
+     * be written. */
+    unsigned long frames, dropped;
+    /*! Characters not written because they had not changed. */
+    unsigned long skipped;
+    /*! Frame latency (lcd_update to the frame being on the LCD); bucket i
+     * counts frames taking less than 2^(i+1) microseconds. */
+    unsigned long latency[LCD_LATENCY_BUCKETS];
+};
+/*!
+ * Get the LCD counters accumulated since lcd_init or lcd_reset_stats.
+ */
+void lcd_get_stats(struct lcd_stats_t*);
+/*!
+ * Reset the LCD counters to zero.
+ */
+void lcd_reset_stats();
+/*!
+ * Print the LCD counters and frame latency histogram to stderr.
+ */
+void lcd_print_stats();
+/*!
+ * \return The DDRAM address of a position on the screen (counting from the
+ * top left, along each row).
+ */
+int lcd_pos_to_addr(int pos);
 /*!
  * \return The number of characters the LCD can display.
  */
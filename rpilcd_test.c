@@ -3,16 +3,53 @@
  * Copyright (C) 2014 James Goode.
  */
 #include <stdio.h>
+#include <string.h>
 #include "rpilcd.h"
 
+// Return 1 if a backend drives the HD44780 model, so that what it wrote can
+// be read back with lcd_sim_read.
+int is_simulated(const char *backend)
+{
+    return strcmp(backend, "sim") == 0 || strcmp(backend, "sim8") == 0 ||
+        strcmp(backend, "term") == 0 || strcmp(backend, "i2c-mock") == 0;
+}
+
 int main(int argc, char* argv[])
 {
+    // The backend can be given as the first argument, for example "i2c-mock".
+    if (argc > 1 && lcd_set_backend(argv[1]) != 0)
+    {
+        fprintf(stderr, "Unknown LCD backend: %s\n", argv[1]);
+        return 1;
+    }
+#ifdef SIMULATE_LCD
+    int simulated = (argc > 1) ? is_simulated(argv[1]) : 1;
+#else
+    int simulated = (argc > 1) ? is_simulated(argv[1]) : 0;
+#endif
     if (lcd_init(LCD_2X16) != 0)
     {
         fprintf(stderr, "Error initialising LCD\n");
         return 1;
     }
+    const char *frame = "0123456789ABCDEFHD44780 LCD     ";
     lcd_2line("0123456789ABCDEF", "HD44780 LCD     ");
+
+    // Check that the bytes sent reached the simulated controller's display
+    // memory.
+    int failed = 0;
+    if (simulated)
+    {
+        char shown[LCD_MAX_SIZE];
+        lcd_sync();
+        lcd_sim_read(shown);
+        if (memcmp(shown, frame, lcd_size()) != 0)
+        {
+            fprintf(stderr, "LCD shows \"%.*s\"\n", lcd_size(), shown);
+            failed = 1;
+        }
+    }
     lcd_close();
+    lcd_print_stats();
+    return failed;
 }
-
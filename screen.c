@@ -0,0 +1,334 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+/*
+
+Screen Rendering
+================
+
+Each mode is a list of widgets (a label, the clock, the track title, a row of
+the file list...) placed on the screen when the LCD is opened.  Drawing a
+frame writes every widget straight into the frame buffer: numbers are
+formatted by hand and long text is shown through a window into the original
+string, so nothing is allocated or copied per frame.
+
+*/
+
+#include <string.h>
+#include "screen.h"
+
+// The solid block character in the HD44780 A00 character ROM.
+#define LCD_CHAR_BLOCK ((char)0xff)
+
+// Custom characters: play and pause icons, and bar segments with one to four
+// of the five columns filled.
+const unsigned char play_glyph[8] =
+    { 0x10, 0x18, 0x1c, 0x1e, 0x1c, 0x18, 0x10, 0x00 };
+const unsigned char pause_glyph[8] =
+    { 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x1b, 0x00 };
+const unsigned char bar_glyph[4][8] = {
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 },
+    { 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18 },
+    { 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c },
+    { 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e, 0x1e }
+};
+
+// Width of the clock ("mm:ss").
+#define SCREEN_CLOCK_LEN 5
+
+// Inputs each kind of widget is drawn from, indexed by
+// enum screen_widget_kind_t.
+#define SCREEN_IN(input) (1 << SCREEN_IN_##input)
+const int screen_kind_inputs[] = {
+    0,
+    SCREEN_IN(STATE) | SCREEN_IN(CLOCK),
+    SCREEN_IN(STATE),
+    SCREEN_IN(STATE),
+    SCREEN_IN(STATE) | SCREEN_IN(TITLE) | SCREEN_IN(SCROLL),
+    SCREEN_IN(STATE),
+    SCREEN_IN(ENTRY),
+    SCREEN_IN(VOLUME)
+};
+
+// Add a widget to a layout, ignoring rows the LCD does not have.
+void screen_add(struct screen_t *screen, enum mode_t mode,
+    enum screen_widget_kind_t kind, int row, int col, int width, int flags,
+    const char *text, int arg)
+{
+    struct screen_layout_t *l = &screen->layout[mode];
+    if (row >= screen->height || l->count >= SCREEN_MAX_WIDGETS) return;
+    struct screen_widget_t *w = &l->widget[l->count++];
+    w->kind = kind;
+    w->row = row;
+    w->col = col;
+    w->width = width;
+    w->flags = flags;
+    w->text = text;
+    w->arg = arg;
+    w->inputs = screen_kind_inputs[kind];
+    // Only the selected entry scrolls.
+    if (kind == SCREEN_ENTRY && arg == 0) w->inputs |= SCREEN_IN(SCROLL);
+    if (kind == SCREEN_CLOCK) l->clock = 1;
+    if (flags & SCREEN_SHOW_LOADING) w->inputs |= SCREEN_IN(LOADING);
+}
+
+void screen_init(struct screen_t *screen)
+{
+    memset(screen, 0, sizeof(*screen));
+    int w = screen->width = lcd_width();
+    int h = screen->height = lcd_height();
+    memset(screen->frame, ' ', sizeof(screen->frame));
+    screen->icon_play = lcd_glyph_pin(play_glyph, '>');
+    screen->icon_pause = lcd_glyph_pin(pause_glyph, '"');
+    // The bar segments are pinned too, as a widget that is not drawn again
+    // keeps the codes it was given.
+    int i = 0;
+    for (i = 0; i < 4; i++)
+        screen->icon_bar[i] = lcd_glyph_pin(bar_glyph[i], '|');
+    screen->invalid = 1;
+
+    // Four line screens have a header; two line screens put the most
+    // important line of it at the top; one line screens show only the main
+    // field of each mode.
+    if (h >= 4)
+    {
+        screen_add(screen, NOW, SCREEN_LABEL, 0, 0, w, SCREEN_CENTER,
+            "Now Playing", 0);
+        screen_add(screen, NOW, SCREEN_ICON, 1, 0, 1, 0, 0, 0);
+        screen_add(screen, NOW, SCREEN_CLOCK, 1, 2, SCREEN_CLOCK_LEN,
+            SCREEN_HIDE_STOPPED, 0, 0);
+        screen_add(screen, NOW, SCREEN_TITLE, 2, 0, w, SCREEN_NO_FILE, 0, 0);
+        screen_add(screen, NOW, SCREEN_PAUSED, 3, 0, w, SCREEN_CENTER, 0, 0);
+
+        screen_add(screen, FILES, SCREEN_LABEL, 0, 0, w - SCREEN_CLOCK_LEN,
+            SCREEN_SHOW_LOADING, "Files", 0);
+        screen_add(screen, FILES, SCREEN_CLOCK, 0, w - SCREEN_CLOCK_LEN,
+            SCREEN_CLOCK_LEN, 0, 0, 0);
+        screen_add(screen, FILES, SCREEN_ENTRY, 1, 0, w, 0, 0, -1);
+        screen_add(screen, FILES, SCREEN_ENTRY, 2, 0, w, 0, 0, 0);
+        screen_add(screen, FILES, SCREEN_ENTRY, 3, 0, w, 0, 0, 1);
+
+        screen_add(screen, VOL, SCREEN_LABEL, 0, 0, w - SCREEN_CLOCK_LEN, 0,
+            "Volume", 0);
+        screen_add(screen, VOL, SCREEN_CLOCK, 0, w - SCREEN_CLOCK_LEN,
+            SCREEN_CLOCK_LEN, 0, 0, 0);
+        screen_add(screen, VOL, SCREEN_BAR, 2, 0, w, 0, 0, 0);
+    } else if (h == 2)
+    {
+        screen_add(screen, NOW, SCREEN_ICON, 0, 0, 1, 0, 0, 0);
+        screen_add(screen, NOW, SCREEN_STATUS, 0, 2,
+            w - SCREEN_CLOCK_LEN - 2, 0, 0, 0);
+        screen_add(screen, NOW, SCREEN_CLOCK, 0, w - SCREEN_CLOCK_LEN,
+            SCREEN_CLOCK_LEN, 0, 0, 0);
+        screen_add(screen, NOW, SCREEN_TITLE, 1, 0, w, 0, 0, 0);
+
+        // The entry before the cursor gives way to the loading count.
+        screen_add(screen, FILES, SCREEN_ENTRY, 0, 0, w, SCREEN_SHOW_LOADING,
+            0, -1);
+        screen_add(screen, FILES, SCREEN_ENTRY, 1, 0, w, 0, 0, 0);
+
+        screen_add(screen, VOL, SCREEN_LABEL, 0, 0, w - SCREEN_CLOCK_LEN, 0,
+            "Volume", 0);
+        screen_add(screen, VOL, SCREEN_CLOCK, 0, w - SCREEN_CLOCK_LEN,
+            SCREEN_CLOCK_LEN, 0, 0, 0);
+        screen_add(screen, VOL, SCREEN_BAR, 1, 0, w, 0, 0, 0);
+    } else {
+        screen_add(screen, NOW, SCREEN_TITLE, 0, 0, w, 0, 0, 0);
+        screen_add(screen, FILES, SCREEN_ENTRY, 0, 0, w, 0, 0, 0);
+        screen_add(screen, VOL, SCREEN_BAR, 0, 0, w, 0, 0, 0);
+    }
+}
+
+int screen_scroll_offset(int len, int width, int scroll_pos, int *steps)
+{
+    *steps = 0;
+    if (len <= width) return 0;
+    *steps = len - width + 10;
+    int step = scroll_pos % *steps;
+    if (step <= 5) return 0;
+    return (step - 5 > len - width) ? (len - width) : (step - 5);
+}
+
+// Copy up to len characters of text into a widget, padding it with spaces.
+void screen_put(struct screen_t *screen, const struct screen_widget_t *w,
+    int offset, const char *text, int len)
+{
+    char *dest = &screen->frame[w->row * screen->width + w->col];
+    int width = w->width - offset;
+    if (len > width) len = width;
+    if (len < 0) len = 0;
+    int start = offset;
+    if (w->flags & SCREEN_CENTER) start += (width - len) / 2;
+    memset(dest, ' ', w->width);
+    memcpy(dest + start, text, len);
+}
+
+// Draw text that scrolls if it does not fit, after a one character prefix
+// if prefix is not 0.
+void screen_put_scrolled(struct screen_t *screen, struct screen_widget_t *w,
+    char prefix, const struct title_t *text, int scroll_pos)
+{
+    int offset = prefix ? 1 : 0;
+    int start = screen_scroll_offset(text->len, w->width - offset, scroll_pos,
+        &w->steps);
+    screen_put(screen, w, offset, text->text + start, text->len - start);
+    if (prefix) screen->frame[w->row * screen->width + w->col] = prefix;
+}
+
+void screen_draw_widget(struct screen_t *screen, struct screen_widget_t *w,
+    const struct screen_state_t *st)
+{
+    w->steps = 0;
+    int stopped = (st->state != PLAYING && st->state != PAUSED);
+    if (stopped && (w->flags & SCREEN_HIDE_STOPPED))
+    {
+        screen_put(screen, w, 0, "", 0);
+        return;
+    }
+    if ((w->flags & SCREEN_SHOW_LOADING) && st->loading >= 0)
+    {
+        char text[20] = "Loading ", digits[10];
+        int len = 8, n = st->loading, count = 0;
+        do digits[count++] = '0' + n % 10; while ((n /= 10) > 0);
+        while (count > 0) text[len++] = digits[--count];
+        screen_put(screen, w, 0, text, len);
+        return;
+    }
+
+    switch (w->kind)
+    {
+    case SCREEN_LABEL:
+        screen_put(screen, w, 0, w->text, strlen(w->text));
+        break;
+    case SCREEN_CLOCK: {
+        char clock[SCREEN_CLOCK_LEN] = { '-', '-', ':', '-', '-' };
+        if (!stopped)
+        {
+            int minutes = (st->position_seconds / 60) % 100;
+            int seconds = st->position_seconds % 60;
+            clock[0] = '0' + minutes / 10;
+            clock[1] = '0' + minutes % 10;
+            clock[3] = '0' + seconds / 10;
+            clock[4] = '0' + seconds % 10;
+        }
+        screen_put(screen, w, 0, clock, SCREEN_CLOCK_LEN);
+        break; }
+    case SCREEN_ICON: {
+        char icon = ' ';
+        if (st->state == PLAYING) icon = screen->icon_play;
+        if (st->state == PAUSED) icon = screen->icon_pause;
+        screen_put(screen, w, 0, &icon, 1);
+        break; }
+    case SCREEN_STATUS: {
+        const char *status = (st->state == PLAYING) ? "PLAYING" :
+            ((st->state == PAUSED) ? "PAUSED" : "NO FILE");
+        screen_put(screen, w, 0, status, strlen(status));
+        break; }
+    case SCREEN_TITLE:
+        if (stopped && (w->flags & SCREEN_NO_FILE))
+        {
+            struct screen_widget_t centred = *w;
+            centred.flags |= SCREEN_CENTER;
+            screen_put(screen, &centred, 0, "NO FILE", 7);
+        } else if (stopped || !st->title)
+        {
+            screen_put(screen, w, 0, "", 0);
+        } else {
+            screen_put_scrolled(screen, w, 0, st->title, st->scroll_pos);
+        }
+        break;
+    case SCREEN_PAUSED:
+        if (st->state == PAUSED) screen_put(screen, w, 0, "PAUSED", 6);
+        else screen_put(screen, w, 0, "", 0);
+        break;
+    case SCREEN_ENTRY: {
+        const struct title_t *name = st->entry[w->arg + 1];
+        if (!name) screen_put(screen, w, 0, "", 0);
+        else if (w->arg == 0)
+            screen_put_scrolled(screen, w, '-', name, st->scroll_pos);
+        else
+        {
+            screen_put(screen, w, 1, name->text, name->len);
+            screen->frame[w->row * screen->width + w->col] = ' ';
+        }
+        break; }
+    case SCREEN_BAR: {
+        // Each character is five columns of pixels; full characters use
+        // the solid block in the LCD's ROM and the partly filled one a
+        // custom character.
+        char *dest = &screen->frame[w->row * screen->width + w->col];
+        int filled = st->volume * w->width * 5 / 13;
+        int i = 0;
+        for (i = 0; i < w->width; i++)
+        {
+            int columns = filled - i * 5;
+            if (columns >= 5) dest[i] = LCD_CHAR_BLOCK;
+            else if (columns > 0) dest[i] = screen->icon_bar[columns - 1];
+            else dest[i] = ' ';
+        }
+        break; }
+    }
+}
+
+void screen_render(struct screen_t *screen, const struct screen_state_t *st)
+{
+    struct screen_layout_t *l = &screen->layout[st->mode];
+    const struct screen_state_t *last = &screen->last;
+    int size = screen->width * screen->height;
+    if (st->mode != last->mode) screen->invalid = 1;
+    if (screen->invalid) memset(screen->frame, ' ', size);
+
+    // Move on the generation of each input that has changed.  Strings are
+    // compared by pointer; the player changes title_gen or list_gen when
+    // the memory they point to is replaced.
+    int changed[SCREEN_INPUTS];
+    changed[SCREEN_IN_STATE] = st->state != last->state;
+    changed[SCREEN_IN_CLOCK] = st->position_seconds != last->position_seconds;
+    changed[SCREEN_IN_TITLE] =
+        st->title != last->title || st->title_gen != last->title_gen;
+    changed[SCREEN_IN_SCROLL] = st->scroll_pos != last->scroll_pos;
+    changed[SCREEN_IN_VOLUME] = st->volume != last->volume;
+    changed[SCREEN_IN_ENTRY] = st->list_gen != last->list_gen ||
+        memcmp(st->entry, last->entry, sizeof(st->entry)) != 0;
+    changed[SCREEN_IN_LOADING] = st->loading != last->loading;
+    int i = 0, j = 0;
+    for (i = 0; i < SCREEN_INPUTS; i++)
+        if (changed[i]) screen->gen[i]++;
+    screen->last = *st;
+
+    // Draw the widgets that have changed, noting the span of the frame
+    // they cover.
+    int first = size, end = 0;
+    screen->scroll_steps = 0;
+    screen->cells_drawn = 0;
+    for (i = 0; i < l->count; i++)
+    {
+        struct screen_widget_t *w = &l->widget[i];
+        unsigned int gen = 0;
+        for (j = 0; j < SCREEN_INPUTS; j++)
+            if (w->inputs & (1 << j)) gen += screen->gen[j];
+        if (screen->invalid || gen != w->drawn)
+        {
+            screen_draw_widget(screen, w, st);
+            w->drawn = gen;
+            int pos = w->row * screen->width + w->col;
+            if (pos < first) first = pos;
+            if (pos + w->width > end) end = pos + w->width;
+            screen->cells_drawn += w->width;
+        }
+        if (w->steps > screen->scroll_steps)
+            screen->scroll_steps = w->steps;
+    }
+    screen->clock_shown = l->clock;
+
+    // Blank rows between widgets must be sent after a change of mode.
+    if (screen->invalid)
+    {
+        first = 0;
+        end = size;
+        screen->invalid = 0;
+    }
+    if (end > first)
+        lcd_update_range(first, &screen->frame[first], end - first);
+}
@@ -0,0 +1,187 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+#include "rpilcd.h"
+#include "play.h"
+#include "title.h"
+
+/*!
+ * Largest number of widgets on one screen.
+ */
+#define SCREEN_MAX_WIDGETS 8
+
+/*!
+ * Everything shown on the screen, copied out of the player's state before
+ * drawing.  Strings are not copied; they must stay valid until screen_render
+ * returns.
+ */
+struct screen_state_t
+{
+    enum mode_t mode;
+    enum player_state_t state;
+    int position_seconds;
+    /*! Title of the current track, or null. */
+    const struct title_t *title;
+    /*!
+     * Changed by the player whenever title is replaced, so the renderer can
+     * tell a new title from an old one without comparing the strings.
+     */
+    unsigned int title_gen;
+    int scroll_pos;
+    /*! Volume from 0 to 13. */
+    int volume;
+    /*!
+     * Names of the directory entries before, at and after the cursor, or
+     * null where the cursor is at the start or end of the list.
+     */
+    const struct title_t *entry[3];
+    /*! Changed by the player whenever the directory list is replaced. */
+    unsigned int list_gen;
+    /*! Entries read so far of a directory still being read, or -1. */
+    int loading;
+};
+
+/*!
+ * Parts of the state a widget is drawn from, as bits of
+ * screen_widget_t::inputs and indexes of screen_t::gen.
+ */
+enum screen_input_t
+{
+    SCREEN_IN_STATE,
+    SCREEN_IN_CLOCK,
+    SCREEN_IN_TITLE,
+    SCREEN_IN_SCROLL,
+    SCREEN_IN_VOLUME,
+    SCREEN_IN_ENTRY,
+    SCREEN_IN_LOADING,
+    SCREEN_INPUTS
+};
+
+/*!
+ * Kinds of widget.
+ */
+enum screen_widget_kind_t
+{
+    /*! Constant text. */
+    SCREEN_LABEL,
+    /*! Track position as mm:ss, or --:-- when stopped. */
+    SCREEN_CLOCK,
+    /*! Play or pause icon, blank when stopped. */
+    SCREEN_ICON,
+    /*! PLAYING, PAUSED or NO FILE. */
+    SCREEN_STATUS,
+    /*! Track title, scrolled if it is too long. */
+    SCREEN_TITLE,
+    /*! PAUSED while the player is paused. */
+    SCREEN_PAUSED,
+    /*! Directory entry before, at or after the cursor (arg -1, 0 or 1). */
+    SCREEN_ENTRY,
+    /*! Volume bar. */
+    SCREEN_BAR
+};
+
+/*!
+ * Widget flags: centre the text in the widget; blank the widget while the
+ * player is stopped; show NO FILE instead of a title while stopped; show
+ * "Loading n" instead while a directory is being read.
+ */
+#define SCREEN_CENTER 1
+#define SCREEN_HIDE_STOPPED 2
+#define SCREEN_NO_FILE 4
+#define SCREEN_SHOW_LOADING 8
+
+/*!
+ * A field of the screen: where it is and what it shows.
+ */
+struct screen_widget_t
+{
+    enum screen_widget_kind_t kind;
+    int row, col, width;
+    int flags;
+    /*! Text of a label. */
+    const char *text;
+    /*! Entry offset for SCREEN_ENTRY. */
+    int arg;
+    /*! Bits (1 << SCREEN_IN_*) for the inputs the widget is drawn from. */
+    int inputs;
+    /*!
+     * Sum of the generations of the inputs when the widget was last drawn;
+     * the widget is drawn again only when this changes.
+     */
+    unsigned int drawn;
+    /*! Steps in the scroll animation of the widget's text (0 if none). */
+    int steps;
+};
+
+/*!
+ * Widgets making up the screen for one mode on one size of LCD.  Columns
+ * and widths are worked out for the LCD by screen_init.
+ */
+struct screen_layout_t
+{
+    int count;
+    /*! Set if the layout shows the track position. */
+    int clock;
+    struct screen_widget_t widget[SCREEN_MAX_WIDGETS];
+};
+
+/*!
+ * The renderer: a frame the size of the LCD and the layout of each mode.
+ * Each input has a generation counter that is incremented when its value
+ * changes between frames, so only widgets reading a changed input are drawn
+ * again and sent to the LCD.
+ */
+struct screen_t
+{
+    int width, height;
+    char frame[LCD_MAX_SIZE];
+    /*! Layouts indexed by enum mode_t. */
+    struct screen_layout_t layout[3];
+    /*! Character codes of the play and pause icons, and of the bar
+     * segments with one to four columns filled. */
+    char icon_play, icon_pause;
+    char icon_bar[4];
+    /*! Generation of each input (SCREEN_IN_*). */
+    unsigned int gen[SCREEN_INPUTS];
+    /*! The state last drawn. */
+    struct screen_state_t last;
+    /*! Set when every widget must be drawn, as after a change of mode. */
+    int invalid;
+    /*!
+     * Set by screen_render: the number of steps in the scroll animation of
+     * a field too long for the screen (0 if none), whether the track
+     * position is shown and the number of characters drawn.
+     */
+    int scroll_steps;
+    int clock_shown;
+    int cells_drawn;
+};
+
+/*!
+ * Work out the layouts for the LCD opened with lcd_init, and pin the play
+ * and pause icons and the volume bar segments in the LCD.
+ */
+void screen_init(struct screen_t *screen);
+
+/*!
+ * Draw the screen for a state into screen->frame and send the characters
+ * that were drawn to the LCD.  Widgets whose inputs have not changed since
+ * the last call are left alone.  Does not allocate memory.
+ */
+void screen_render(struct screen_t *screen, const struct screen_state_t *st);
+
+/*!
+ * Return the offset of the first character to show of len characters of
+ * text in a field of the given width at a step of the scroll animation.
+ * Text that fits is not scrolled.  The text stays still for the first and
+ * last five steps to make it easier to read.
+ * \param steps Set to the number of steps in the animation, or 0 if the
+ * text fits.
+ */
+int screen_scroll_offset(int len, int width, int scroll_pos, int *steps);
+
+#endif
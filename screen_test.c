@@ -0,0 +1,163 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+/*
+
+Draws screens for every mode on a simulated 4x20 LCD and checks that no
+memory is allocated while drawing them.  malloc and friends are replaced with
+versions that count calls and pass them on to the C library.
+
+*/
+#include <stdio.h>
+#include <string.h>
+#include "rpilcd.h"
+#include "screen.h"
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void*, size_t);
+
+// Allocations made while counting is set.
+int counting;
+unsigned long allocations;
+
+void *malloc(size_t size)
+{
+    if (counting) __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (counting) __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    if (counting) __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+
+// Compare a row of the last frame with the expected text.
+int check_row(struct screen_t *screen, int row, const char *expected)
+{
+    if (memcmp(&screen->frame[row * screen->width], expected,
+        screen->width) == 0) return 0;
+    fprintf(stderr, "Row %d is \"%.*s\", expected \"%s\"\n", row,
+        screen->width, &screen->frame[row * screen->width], expected);
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (lcd_set_backend("sim") != 0 || lcd_init(LCD_4X20) != 0)
+    {
+        fprintf(stderr, "Error initialising LCD\n");
+        return 1;
+    }
+    struct screen_t screen;
+    screen_init(&screen);
+
+    const struct title_t *names[] = { title_new("Directory", 0),
+        title_new("A track with a long name.mp3", 0),
+        title_new("Short.mp3", 0), 0 };
+    struct screen_state_t st;
+    memset(&st, 0, sizeof(st));
+    st.loading = -1;
+    st.title = title_new("A track with a long name.mp3",
+        TITLE_STRIP_EXTENSION);
+    st.volume = 7;
+
+    // Draw one frame first so that anything set up on first use is not
+    // counted.
+    screen_render(&screen, &st);
+    lcd_sync();
+
+    int failed = 0, frame = 0;
+    counting = 1;
+    for (frame = 0; frame < 1000; frame++)
+    {
+        st.mode = frame % 3;
+        st.state = (frame / 3) % 3;
+        st.position_seconds = frame;
+        st.scroll_pos = frame % 40;
+        st.volume = frame % 14;
+        st.entry[0] = names[frame % 4];
+        st.entry[1] = names[(frame + 1) % 4];
+        st.entry[2] = names[(frame + 2) % 4];
+        screen_render(&screen, &st);
+    }
+    lcd_sync();
+    counting = 0;
+    if (allocations != 0)
+    {
+        fprintf(stderr, "%lu allocations drawing 1000 frames\n",
+            allocations);
+        failed = 1;
+    }
+
+    st.mode = NOW;
+    st.state = PLAYING;
+    st.position_seconds = 65;
+    st.scroll_pos = 8;
+    screen_render(&screen, &st);
+    failed |= check_row(&screen, 0, "    Now Playing     ");
+    failed |= check_row(&screen, 2, "rack with a long nam");
+
+    // A clock tick draws only the clock.
+    st.position_seconds = 66;
+    screen_render(&screen, &st);
+    char clock_row[] = "> 01:06             ";
+    clock_row[0] = screen.icon_play;
+    failed |= check_row(&screen, 1, clock_row);
+    if (screen.cells_drawn != 5)
+    {
+        fprintf(stderr, "Clock tick drew %d characters\n",
+            screen.cells_drawn);
+        failed = 1;
+    }
+
+    // The LCD shows the whole frame, not just the characters last sent.
+    lcd_sync();
+    char shown[LCD_MAX_SIZE];
+    lcd_sim_read(shown);
+    if (memcmp(shown, screen.frame, lcd_size()) != 0)
+    {
+        fprintf(stderr, "LCD differs from frame\n");
+        failed = 1;
+    }
+    st.position_seconds = 65;
+
+    st.mode = FILES;
+    st.scroll_pos = 0;
+    st.entry[0] = 0;
+    st.entry[1] = names[0];
+    st.entry[2] = names[2];
+    screen_render(&screen, &st);
+    failed |= check_row(&screen, 0, "Files          01:05");
+    failed |= check_row(&screen, 1, "                    ");
+    failed |= check_row(&screen, 2, "-Directory          ");
+    failed |= check_row(&screen, 3, " Short.mp3          ");
+
+    // The header counts the entries read while a directory is loading.
+    st.loading = 130;
+    screen_render(&screen, &st);
+    failed |= check_row(&screen, 0, "Loading 130    01:05");
+    failed |= check_row(&screen, 2, "-Directory          ");
+
+    // UTF-8 names are shown in the LCD's character set.
+    struct title_t *t = title_new(
+        "Mot\xc3\xb6rhead \xe2\x80\x93 \\~\xc3\xa9.ogg", TITLE_STRIP_EXTENSION);
+    if (strcmp(t->text, "Mot\xefrhead - /-e") != 0 || t->len != 15)
+    {
+        fprintf(stderr, "Title is \"%s\"\n", t->text);
+        failed = 1;
+    }
+
+    lcd_close();
+    if (failed) return 1;
+    printf("screen_test ok\n");
+    return 0;
+}
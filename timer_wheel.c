@@ -0,0 +1,94 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "timer_wheel.h"
+
+unsigned long long timer_now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+int timer_wheel_init(struct timer_wheel_t *w)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (w->fd < 0)
+    {
+        fprintf(stderr, "Could not create timerfd\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Set the timerfd to the earliest deadline if it is not already.
+void timer_wheel_program(struct timer_wheel_t *w)
+{
+    unsigned long long next = 0;
+    int i = 0;
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+    {
+        if (w->deadline[i] && (next == 0 || w->deadline[i] < next))
+            next = w->deadline[i];
+    }
+    if (next == w->next) return;
+    w->next = next;
+
+    // An all zero it_value disarms the timerfd.
+    struct itimerspec t;
+    memset(&t, 0, sizeof(t));
+    t.it_value.tv_sec = next / 1000000000ULL;
+    t.it_value.tv_nsec = next % 1000000000ULL;
+    timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &t, 0);
+}
+
+void timer_wheel_arm(struct timer_wheel_t *w, int slot,
+    unsigned long long deadline_ns)
+{
+    w->deadline[slot] = deadline_ns ? deadline_ns : 1;
+    timer_wheel_program(w);
+}
+
+void timer_wheel_cancel(struct timer_wheel_t *w, int slot)
+{
+    if (!w->deadline[slot]) return;
+    w->deadline[slot] = 0;
+    timer_wheel_program(w);
+}
+
+int timer_wheel_armed(const struct timer_wheel_t *w, int slot)
+{
+    return w->deadline[slot] != 0;
+}
+
+unsigned int timer_wheel_expire(struct timer_wheel_t *w)
+{
+    uint64_t v;
+    ssize_t r = read(w->fd, &v, sizeof(v));
+    (void)r;
+
+    // The timerfd has fired, so it must be set again even if the earliest
+    // deadline is unchanged.
+    w->next = 0;
+    unsigned long long now = timer_now_ns();
+    unsigned int expired = 0;
+    int i = 0;
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+    {
+        if (w->deadline[i] && w->deadline[i] <= now)
+        {
+            w->deadline[i] = 0;
+            expired |= 1u << i;
+        }
+    }
+    timer_wheel_program(w);
+    return expired;
+}
@@ -0,0 +1,65 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+/*!
+ * Number of timers a wheel can hold.
+ */
+#define TIMER_WHEEL_SLOTS 4
+
+/*!
+ * A small set of one-shot timers sharing one timerfd.  The timerfd is set to
+ * the earliest armed deadline, so the owner gets one wakeup per expiry and
+ * none at all when no timer is armed.
+ */
+struct timer_wheel_t
+{
+    /*!
+     * The timerfd, for the owner's poll or epoll set.
+     */
+    int fd;
+    // Absolute CLOCK_MONOTONIC deadline of each slot in nanoseconds, or 0.
+    unsigned long long deadline[TIMER_WHEEL_SLOTS];
+    // Deadline the timerfd is set to, or 0 if it is disarmed.
+    unsigned long long next;
+};
+
+/*!
+ * Return the CLOCK_MONOTONIC time in nanoseconds.
+ */
+unsigned long long timer_now_ns();
+
+/*!
+ * Create the timerfd with no timers armed.
+ * \return 0 on success.
+ */
+int timer_wheel_init(struct timer_wheel_t *w);
+
+/*!
+ * Arm a timer, replacing its deadline if it is already armed.
+ * \param deadline_ns Absolute CLOCK_MONOTONIC time in nanoseconds.
+ */
+void timer_wheel_arm(struct timer_wheel_t *w, int slot,
+    unsigned long long deadline_ns);
+
+/*!
+ * Disarm a timer.  Does nothing if it is not armed.
+ */
+void timer_wheel_cancel(struct timer_wheel_t *w, int slot);
+
+/*!
+ * Return 1 if a timer is armed.
+ */
+int timer_wheel_armed(const struct timer_wheel_t *w, int slot);
+
+/*!
+ * Handle the timerfd becoming readable: disarm the timers whose deadlines
+ * have passed and set the timerfd for the rest.
+ * \return A mask of the expired timers (bit n is slot n).
+ */
+unsigned int timer_wheel_expire(struct timer_wheel_t *w);
+
+#endif
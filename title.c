@@ -0,0 +1,117 @@
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "title.h"
+
+// A00 ROM codes for U+00A0 to U+017F: the letters the ROM has, and the
+// unaccented letter for the rest.
+const char title_latin[] =
+    " !\xec" "??\x5c" "??\"C?<?-R?"
+    "\xdf" "?23'\xe4" "?\xa5" "?1?>????"
+    "AAAAAAACEEEEIIII"
+    "DNOOOOOxOUUUUYP\xe2"
+    "aaaa\xe1" "aaceeeeiiii"
+    "d\xee" "oooo\xef" "\xfd" "ouuu\xf5" "ypy"
+    "AaAaAaCcCcCcCcDd"
+    "DdEeEeEeEeEeGgGg"
+    "GgGgHhHhIiIiIiIi"
+    "IiIiJjKkkLlLlLlL"
+    "lLlNnNnNnnNnOoOo"
+    "O\xef" "OoRrRrRrSsSsSs"
+    "SsTtTtTtUuUuUuUu"
+    "U\xf5" "UuWwYyYZzZzZzs";
+
+// Other characters the ROM has.
+const struct { unsigned int c; char lcd; } title_symbols[] = {
+    { 0x03a3, (char)0xf6 }, { 0x03a9, (char)0xf4 }, { 0x03b1, (char)0xe0 },
+    { 0x03b2, (char)0xe2 }, { 0x03b5, (char)0xe3 }, { 0x03b8, (char)0xf2 },
+    { 0x03bc, (char)0xe4 }, { 0x03c0, (char)0xf7 }, { 0x03c1, (char)0xe6 },
+    { 0x03c3, (char)0xe5 }, { 0x2013, '-' }, { 0x2014, '-' },
+    { 0x2018, '\'' }, { 0x2019, '\'' }, { 0x201c, '"' }, { 0x201d, '"' },
+    { 0x2022, (char)0xa5 }, { 0x2190, 0x7f }, { 0x2192, 0x7e },
+    { 0x221a, (char)0xe8 }, { 0x221e, (char)0xf3 }
+};
+
+char title_lcd_char(unsigned int c)
+{
+    // The ROM has a yen sign and a right arrow in place of ASCII's backslash
+    // and tilde.
+    if (c == '\\') return '/';
+    if (c == '~') return '-';
+    if (c >= 0x20 && c < 0x7f) return c;
+    if (c >= 0xa0 && c < 0x180) return title_latin[c - 0xa0];
+    int i = 0;
+    for (i = 0; i < sizeof(title_symbols) / sizeof(title_symbols[0]); i++)
+        if (title_symbols[i].c == c) return title_symbols[i].lcd;
+    return '?';
+}
+
+// Decode the UTF-8 character at s, setting *len to the number of bytes it
+// takes.  A byte that does not start a valid character decodes as U+FFFD on
+// its own.
+unsigned int title_decode(const unsigned char *s, int *len)
+{
+    unsigned int c = s[0];
+    int n = -1, i = 0;
+    if (c < 0x80) n = 0;
+    else if (c >= 0xc2 && c < 0xe0) n = 1;
+    else if (c >= 0xe0 && c < 0xf0) n = 2;
+    else if (c >= 0xf0 && c < 0xf5) n = 3;
+    *len = 1;
+    if (n < 0) return 0xfffd;
+    c &= 0x7f >> n;
+    for (i = 1; i <= n; i++)
+    {
+        if ((s[i] & 0xc0) != 0x80) return 0xfffd;
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    *len = n + 1;
+    return c;
+}
+
+// Number of bytes of the name the title is made from.
+int title_name_len(const char *name, int flags)
+{
+    int size = strlen(name);
+    if (flags & TITLE_STRIP_EXTENSION)
+    {
+        const char *dot = strrchr(name, '.');
+        if (dot && dot != name) size = dot - name;
+    }
+    return size;
+}
+
+int title_size(const char *name, int flags)
+{
+    // Each character takes at least one byte, so the title is no longer
+    // than the name.
+    return sizeof(struct title_t) + title_name_len(name, flags) + 1;
+}
+
+void title_prepare(struct title_t *t, const char *name, int flags)
+{
+    int size = title_name_len(name, flags);
+    const unsigned char *s = (const unsigned char*)name;
+    int pos = 0, len = 0;
+    t->len = 0;
+    while (pos < size)
+    {
+        unsigned int c = title_decode(s + pos, &len);
+        // A character cut short by the end of the name is invalid.
+        if (pos + len > size) c = 0xfffd, len = 1;
+        t->text[t->len++] = title_lcd_char(c);
+        pos += len;
+    }
+    t->text[t->len] = 0;
+}
+
+struct title_t *title_new(const char *name, int flags)
+{
+    struct title_t *t = malloc(title_size(name, flags));
+    if (!t) return 0;
+    title_prepare(t, name, flags);
+    return t;
+}
@@ -0,0 +1,52 @@
+#ifndef TITLE_H
+#define TITLE_H
+/*
+ * RPILCD - A Raspberry Pi Audio Player.
+ * Copyright (C) 2014 James Goode.
+ */
+
+/*!
+ * Remove the extension (".mp3") from the name in title_new.
+ */
+#define TITLE_STRIP_EXTENSION 1
+
+/*!
+ * A name ready to be shown on the LCD: one byte per character, in the
+ * character set of the HD44780's A00 ROM.
+ */
+struct title_t
+{
+    /*! Number of characters, which is also the width on the screen. */
+    int len;
+    char text[];
+};
+
+/*!
+ * Prepare a UTF-8 name (a file name or track title) for the LCD.  Letters
+ * the LCD's ROM has (ä, ö, ü, ñ, ß, µ, °...) are mapped to its codes,
+ * accents are removed from other letters and characters that cannot be
+ * shown become '?'.  ASCII characters the ROM replaces ('\' is ¥ and '~' is
+ * an arrow) are replaced with similar ones.
+ * \param flags TITLE_STRIP_EXTENSION or 0.
+ * \return A title to be freed with free(), or null if out of memory.
+ */
+struct title_t *title_new(const char *name, int flags);
+
+/*!
+ * \return The number of bytes title_prepare needs for the title of a name.
+ */
+int title_size(const char *name, int flags);
+
+/*!
+ * As title_new, but prepare the title in memory the caller provides, which
+ * holds title_size(name, flags) bytes and is aligned for an int.
+ */
+void title_prepare(struct title_t *t, const char *name, int flags);
+
+/*!
+ * Return the A00 ROM character code for a Unicode code point, or '?' if the
+ * LCD cannot show it.
+ */
+char title_lcd_char(unsigned int c);
+
+#endif